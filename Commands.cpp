@@ -3,19 +3,39 @@
 #include <iostream>
 #include <vector>
 #include <set>
+#include <algorithm>
 #include <time.h>
-#include <sstream>
 #include <sys/wait.h>
 #include <iomanip>
 #include <fcntl.h>
+#include <thread>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <limits.h>
 #include "Commands.h"
+#include "signals.h"
 
 using namespace std;
-set<string> built_in_commands {"chprompt", "showpid", "pwd" ,"cd", "jobs",
-                               "kill", "fg", "bg", "quit"};
 
 const std::string WHITESPACE = " \n\r\t\f\v";
-const size_t MAX_COMMAND_LENGTH = 255;
+//anything in here needs bash to expand or interpret the line
+const char* SHELL_SPECIAL_CHARS = "*?[]{}~$`'\"\\;<>|&()#!";
+
+extern char** environ;
 
 #if 0
 #define FUNC_ENTRY()  \
@@ -45,55 +65,251 @@ string _trim(const std::string& s)
     return _rtrim(_ltrim(s));
 }
 
-int _parseCommandLine(const char* cmd_line, char** args) {
+static inline bool _isWhitespace(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\f'
+           || c == '\v';
+}
+
+//splits cmd_line into words. the line is copied once into the arena and
+//cut in place, args[i] point into that copy and args ends with NULL.
+//args starts out with room for capacity words; when the line has more,
+//args is moved to a bigger array taken from the arena
+int _parseCommandLine(const char* cmd_line, char**& args, int capacity,
+                      LineArena* arena) {
     FUNC_ENTRY()
+    size_t len = strlen(cmd_line);
+    char* copy = (char*)arena->allocate(len + 1);
+    memcpy(copy, cmd_line, len + 1);
+
     int i = 0;
-    std::istringstream iss(_trim(string(cmd_line)).c_str());
-    for(std::string s; iss >> s; ) {
-        args[i] = (char*)malloc(s.length()+1);
-        memset(args[i], 0, s.length()+1);
-        strcpy(args[i], s.c_str());
-        args[++i] = NULL;
+    char* pos = copy;
+    while (true) {
+        while (_isWhitespace(*pos)) {
+            pos++;
+        }
+        if (*pos == '\0') {
+            break;
+        }
+        //keep one slot for the terminating NULL
+        if (i + 1 == capacity) {
+            char** bigger = (char**)arena->allocate(2 * capacity * sizeof(char*));
+            memcpy(bigger, args, i * sizeof(char*));
+            args = bigger;
+            capacity *= 2;
+        }
+        args[i++] = pos;
+        while (*pos != '\0' && !_isWhitespace(*pos)) {
+            pos++;
+        }
+        if (*pos != '\0') {
+            *pos++ = '\0';
+        }
     }
+    args[i] = NULL;
     return i;
 
     FUNC_EXIT()
 }
 
+//a copy of the len bytes at s in the arena, without the whitespace around
+//them
+static char* _arenaTrim(const char* s, size_t len, LineArena* arena) {
+    while (len > 0 && _isWhitespace(*s)) {
+        s++;
+        len--;
+    }
+    while (len > 0 && _isWhitespace(s[len - 1])) {
+        len--;
+    }
+    char* copy = (char*)arena->allocate(len + 1);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+//index of the last character before end that isn't whitespace, -1 if none
+static long _lastNonWhitespace(const char* s, size_t end) {
+    while (end > 0 && _isWhitespace(s[end - 1])) {
+        end--;
+    }
+    return (long)end - 1;
+}
+
 bool _isBackgroundComamnd(const char* cmd_line) {
-    const string str(cmd_line);
-    return str[str.find_last_not_of(WHITESPACE)] == '&';
+    long idx = _lastNonWhitespace(cmd_line, strlen(cmd_line));
+    return idx >= 0 && cmd_line[idx] == '&';
 }
 
 void _removeBackgroundSign(char* cmd_line) {
-    const string str(cmd_line);
     // find last character other than spaces
-    unsigned int idx = str.find_last_not_of(WHITESPACE);
-    // if all characters are spaces then return
-    if (idx == string::npos) {
-        return;
-    }
-    // if the cmd_line line does not end with & then return
-    if (cmd_line[idx] != '&') {
+    long idx = _lastNonWhitespace(cmd_line, strlen(cmd_line));
+    // if all characters are spaces or the line does not end with & then return
+    if (idx < 0 || cmd_line[idx] != '&') {
         return;
     }
-    // replace the & (background sign) with space and then remove all tailing spaces.
-    cmd_line[idx] = ' ';
     // truncate the cmd_line line string up to the last non-space character
-    cmd_line[str.find_last_not_of(WHITESPACE, idx) + 1] = 0;
+    // before the & (background sign)
+    cmd_line[_lastNonWhitespace(cmd_line, idx) + 1] = 0;
+}
+
+//====================Output Implementation=============================
+
+thread_local ostream* thread_out = &cout;
+thread_local int thread_out_fd = 1;
+
+ostream& shellOut() {
+    return *thread_out;
+}
+
+int shellOutFd() {
+    return thread_out_fd;
+}
+
+OutputRedirect::OutputRedirect(ostream* out, int fd)
+        : saved(thread_out), saved_fd(thread_out_fd) {
+    thread_out = out;
+    thread_out_fd = fd;
+}
+
+OutputRedirect::~OutputRedirect() {
+    thread_out = saved;
+    thread_out_fd = saved_fd;
+}
+
+//write() until everything is out, false on error
+//cancel_fd is for a non-blocking fd, a full pipe is waited on until
+//cancel_fd becomes readable
+static bool _writeAll(int fd, const char* data, size_t len,
+                      int cancel_fd = -1) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN && cancel_fd != -1) {
+                struct pollfd pfds[2] = {{fd, POLLOUT, 0},
+                                         {cancel_fd, POLLIN, 0}};
+                if (poll(pfds, 2, -1) < 0 && errno != EINTR) {
+                    return false;
+                }
+                if (pfds[1].revents != 0) {
+                    return false;
+                }
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+FdWriter::FdWriter(int fd, int cancel_fd) : fd(fd), cancel_fd(cancel_fd) {
+    setp(buffer, buffer + sizeof(buffer));
+}
+
+FdWriter::~FdWriter() {
+    sync();
+}
+
+int FdWriter::overflow(int c) {
+    if (sync() == -1) {
+        return traits_type::eof();
+    }
+    if (c != traits_type::eof()) {
+        *pptr() = (char)c;
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+streamsize FdWriter::xsputn(const char* data, streamsize len) {
+    if (len <= epptr() - pptr()) {
+        memcpy(pptr(), data, len);
+        pbump(len);
+        return len;
+    }
+    //too big for what is left, don't bother copying it into the buffer
+    if (sync() == -1 || !_writeAll(fd, data, len, cancel_fd)) {
+        return 0;
+    }
+    written += len;
+    return len;
+}
+
+int FdWriter::sync() {
+    bool ok = _writeAll(fd, pbase(), pptr() - pbase(), cancel_fd);
+    if (ok) {
+        written += pptr() - pbase();
+    }
+    setp(buffer, buffer + sizeof(buffer));
+    return ok ? 0 : -1;
+}
+
+//====================Line Arena Implementation=========================
+
+LineArena::~LineArena() {
+    reset();
+    for (char* block : blocks) {
+        free(block);
+    }
+}
+
+void* LineArena::allocate(size_t size) {
+    //keep every allocation aligned for any type
+    const size_t align = alignof(max_align_t);
+    size = (size + align - 1) & ~(align - 1);
+    if (size > BLOCK_SIZE) {
+        char* mem = (char*)malloc(size);
+        if (mem == nullptr) {
+            throw bad_alloc();
+        }
+        large.push_back(mem);
+        return mem;
+    }
+    if (blocks.empty() || offset + size > BLOCK_SIZE) {
+        if (!blocks.empty()) {
+            current++;
+        }
+        if (current == blocks.size()) {
+            char* block = (char*)malloc(BLOCK_SIZE);
+            if (block == nullptr) {
+                throw bad_alloc();
+            }
+            blocks.push_back(block);
+        }
+        offset = 0;
+    }
+    void* mem = blocks[current] + offset;
+    offset += size;
+    return mem;
+}
+
+void LineArena::reset() {
+    for (char* mem : large) {
+        free(mem);
+    }
+    large.clear();
+    current = 0;
+    offset = 0;
 }
 
 //====================Commands Implementation===========================
-Command::Command(const char* cmd_line) : cmd_line(cmd_line) {
-    num_args = _parseCommandLine(cmd_line, args);
+Command::Command(const char* cmd_line) : cmd_line(cmd_line),
+        args(inline_args) {
+    num_args = _parseCommandLine(cmd_line, args, COMMAND_MAX_ARGS + 1,
+                                 SmallShell::getInstance().getArena());
 }
 
 
 Command::~Command() {
-    for (int i = 0; i < num_args; ++i) {
-        free(args[i]);
-        args[i] = NULL;
-    }
+    //the words live in the line arena
+}
+
+void* Command::operator new(size_t size) {
+    return SmallShell::getInstance().getArena()->allocate(size);
 }
 
 //====================BuiltIn Commands Implementation===================
@@ -105,7 +321,7 @@ ShowPidCommand::ShowPidCommand(const char* cmd_line)
 
 void ShowPidCommand::execute() {
     SmallShell& shell = SmallShell::getInstance();
-    std::cout<< "smash pid is "<< shell.getPid() << std::endl;
+    shellOut() << "smash pid is "<< shell.getPid() << "\n";
     int pid = getpid();
     if (pid < 0){
         perror("smash error: getpid failed");
@@ -118,9 +334,9 @@ GetCurrDirCommand::GetCurrDirCommand(const char* cmd_line)
         : BuiltInCommand(cmd_line) {}
 
 void GetCurrDirCommand::execute() {
-    char buffer[MAX_COMMAND_LENGTH];
+    char buffer[PATH_MAX];
     if(getcwd(buffer,sizeof(buffer))!= NULL) {
-        std::cout<< buffer << std::endl;
+        shellOut() << buffer << "\n";
     } else{
         perror("smash error: getcwd failed");
     }
@@ -152,8 +368,8 @@ ChangeDirCommand::~ChangeDirCommand() {
 
 void ChangeDirCommand::execute() {
 
-    char* buf = getcwd(nullptr ,COMMAND_ARGS_MAX_LENGTH);
-    if (buf == nullptr) {
+    char buf[PATH_MAX];
+    if (getcwd(buf, sizeof(buf)) == nullptr) {
         perror("smash error: getcwd failed");
         return;
     }
@@ -205,76 +421,801 @@ void ChangeDirCommand::execute() {
 ExternalCommand::ExternalCommand(const char *cmd_line,
                                  SmallShell* shell, JobsList *jobs): Command(cmd_line), shell(shell) {
     jl = jobs;
+    job_line = cmd_line;
 }
 
-void ExternalCommand::execute() {
+void ExternalCommand::setTimeout(int secs, const char* timeout_line) {
+    timeout_secs = secs;
+    job_line = timeout_line;
+}
 
-//    char* arg = (char*)malloc((sizeof(cmd_line)+1)/sizeof(char));
-    char arg[COMMAND_ARGS_MAX_LENGTH];
-    strcpy(arg, cmd_line);
-    bool isBG = _isBackgroundComamnd(cmd_line);
-    _removeBackgroundSign(arg);
+//a line can skip bash when splitting it on whitespace gives the real argv
+static bool _isSimpleCommand(const char* cmd_line) {
+    if (strpbrk(cmd_line, SHELL_SPECIAL_CHARS) != nullptr) {
+        return false;
+    }
+    //a leading NAME=value is a variable assignment for bash
+    const char* first = cmd_line + strspn(cmd_line, WHITESPACE.c_str());
+    const char* eq = strchr(first, '=');
+    return eq == nullptr || eq > first + strcspn(first, WHITESPACE.c_str());
+}
 
-    //this way we don't get warnings about convertion
-    char* bash = (char *)"/bin/bash";
-    char* flag = (char *)"-c";
-    char* const paramlist[] = {bash, flag, arg, NULL};
+//quotes, escapes and expansions can hide a < or > from a plain scan, only
+//bash knows where the redirections of such a line are
+static bool _hasShellQuoting(const char* cmd_line) {
+    return strpbrk(cmd_line, "'\"\\`$") != nullptr;
+}
 
-    int pid = fork();
+//===========================PATH cache Implementation=================================
+
+//re-read PATH if it changed and drop entries a directory change may have
+//invalidated. directories are checked at most once a second
+void PathCache::validate() {
+    const char* env = getenv("PATH");
+    string current = env == nullptr ? "" : env;
+    time_t now = time(nullptr);
+    if (current != path_env) {
+        clear();
+        path_env = current;
+        dirs.clear();
+        size_t start = 0;
+        while (start <= path_env.size()) {
+            size_t end = path_env.find(':', start);
+            if (end == string::npos) {
+                end = path_env.size();
+            }
+            dirs.push_back(path_env.substr(start, end - start));
+            start = end + 1;
+        }
+        last_check = 0;
+        dir_mtimes.assign(dirs.size(), timespec());
+    }
+    if (now == last_check) {
+        return;
+    }
+    last_check = now;
+    struct stat st;
+    size_t first_changed = dirs.size();
+    for (size_t i = 0; i < dirs.size(); ++i) {
+        struct timespec mtime = timespec();
+        if (stat(dirs[i].c_str(), &st) == 0) {
+            mtime = st.st_mtim;
+        }
+        if (mtime.tv_sec != dir_mtimes[i].tv_sec
+            || mtime.tv_nsec != dir_mtimes[i].tv_nsec) {
+            dir_mtimes[i] = mtime;
+            if (first_changed == dirs.size()) {
+                first_changed = i;
+            }
+        }
+    }
+    //a change in directory i can only shadow or remove entries found in i or later
+    for (auto i = entries.begin(); i != entries.end(); ) {
+        if (i->second.dir_index >= first_changed) {
+            i = entries.erase(i);
+        } else {
+            ++i;
+        }
+    }
+}
 
-    int tempjobId = -1;
+//find the executable the way execvp would, without going through bash
+bool PathCache::lookup(const char* name, string* path) {
+    if (strchr(name, '/') != nullptr) {
+        *path = name;
+        return access(name, X_OK) == 0;
+    }
+    validate();
+    auto it = entries.find(name);
+    if (it != entries.end()) {
+        it->second.hits++;
+        *path = it->second.path;
+        return true;
+    }
+    struct stat st;
+    for (size_t i = 0; i < dirs.size(); ++i) {
+        //an empty PATH entry means the current directory
+        *path = (dirs[i].empty() ? string(".") : dirs[i]) + "/" + name;
+        if (stat(path->c_str(), &st) == 0 && S_ISREG(st.st_mode)
+            && access(path->c_str(), X_OK) == 0) {
+            //relative entries depend on the current directory, don't keep them
+            if (!dirs[i].empty() && dirs[i][0] == '/') {
+                Entry& entry = entries[name];
+                entry.path = *path;
+                entry.hits = 1;
+                entry.dir_index = i;
+            }
+            return true;
+        }
+    }
+    return false;
+}
 
-    if(pid == -1) {
-        perror("smash error: fork failed");
+void PathCache::forget(const char* name) {
+    entries.erase(name);
+}
+
+void PathCache::clear() {
+    entries.clear();
+}
+
+void PathCache::printEntries() {
+    if (entries.empty()) {
+        shellOut() << "smash: hash: hash table empty" << "\n";
+        return;
+    }
+    vector<const Entry*> sorted;
+    for (auto i = entries.begin(); i != entries.end(); ++i) {
+        sorted.push_back(&i->second);
     }
+    sort(sorted.begin(), sorted.end(), [](const Entry* a, const Entry* b) {
+        return a->path < b->path;
+    });
+    shellOut() << "hits\tcommand" << "\n";
+    for (const Entry* entry : sorted) {
+        shellOut() << setw(4) << entry->hits << "\t" << entry->path << "\n";
+    }
+}
 
-    if(pid == 0) {
-        if (setpgrp() == -1){
-            perror("smash error: setpgrp failed");
-        }
-        int cpid = getpid();
-        if (cpid < 0){
-            perror("smash error: getpid failed");
+HashCommand::HashCommand(const char *cmd_line, PathCache *cache)
+        : BuiltInCommand(cmd_line), cache(cache) {}
+
+void HashCommand::execute() {
+    if (num_args == 1) {
+        cache->printEntries();
+        return;
+    }
+    if (strcmp(args[1], "-r") == 0) {
+        cache->clear();
+        return;
+    }
+    string path;
+    for (int i = 1; i < num_args; ++i) {
+        if (!cache->lookup(args[i], &path)) {
+            cerr << "smash error: hash: " << args[i] << ": not found" << endl;
         }
+    }
+}
 
-        setpgrp();
-        execvp("/bin/bash", paramlist);
+//===========================FdPlan Implementation=================================
 
-        perror("smash error: executioin failed\n");
+void FdPlan::add(const Action& action) {
+    if (num_actions == capacity) {
+        Action* bigger = (Action*)SmallShell::getInstance().getArena()->allocate(
+                2 * capacity * sizeof(Action));
+        memcpy(bigger, actions, num_actions * sizeof(Action));
+        actions = bigger;
+        capacity *= 2;
+    }
+    actions[num_actions++] = action;
+}
 
-        if (kill(cpid, SIGKILL) < 0){
-            perror("smash error: kill failed");
+void FdPlan::addDup2(int src_fd, int fd) {
+    Action action;
+    action.type = Action::DUP2;
+    action.fd = fd;
+    action.src_fd = src_fd;
+    action.path = nullptr;
+    add(action);
+}
+
+void FdPlan::addClose(int fd) {
+    Action action;
+    action.type = Action::CLOSE;
+    action.fd = fd;
+    action.src_fd = -1;
+    action.path = nullptr;
+    add(action);
+}
+
+void FdPlan::addOpen(int fd, const char* path, int flags) {
+    Action action;
+    action.type = Action::OPEN;
+    action.fd = fd;
+    action.src_fd = -1;
+    action.path = path;
+    action.flags = flags;
+    add(action);
+}
+
+void FdPlan::addAll(const FdPlan& other) {
+    for (const Action& action : other) {
+        add(action);
+    }
+}
+
+bool FdPlan::hasOpen() const {
+    for (const Action& action : *this) {
+        if (action.type == Action::OPEN) {
+            return true;
         }
     }
-    else {
+    return false;
+}
+
+bool FdPlan::canOpen() const {
+    for (const Action& action : *this) {
+        if (action.type != Action::OPEN) {
+            continue;
+        }
+        int fd = open(action.path, action.flags | O_CLOEXEC, 0666);
+        if (fd == -1) {
+            return false;
+        }
+        close(fd);
+    }
+    return true;
+}
 
-        if(isBG) {
-            tempjobId = jl->addJob(cmd_line, pid, false);
+bool FdPlan::touches(int fd) const {
+    for (const Action& action : *this) {
+        if (action.fd == fd) {
+            return true;
+        }
+    }
+    return false;
+}
 
-            if(tempjobId == -1) {
-                perror("smash error: couldn't add a job to list");
+bool FdPlan::apply() const {
+    for (const Action& action : *this) {
+        if (action.type == Action::OPEN) {
+            int fd = open(action.path, action.flags, 0666);
+            if (fd < 0) {
+                perror("smash error: open failed");
+                return false;
             }
+            if (fd != action.fd) {
+                if (dup2(fd, action.fd) < 0) {
+                    perror("smash error: dup2 failed");
+                    close(fd);
+                    return false;
+                }
+                close(fd);
+            }
+        } else if (action.type == Action::DUP2) {
+            if (dup2(action.src_fd, action.fd) < 0) {
+                perror("smash error: dup2 failed");
+                return false;
+            }
+        } else if (close(action.fd) < 0) {
+            perror("smash error: close failed");
+            return false;
+        }
+    }
+    return true;
+}
+
+void FdPlan::fillSpawnActions(posix_spawn_file_actions_t* file_actions) const {
+    for (const Action& action : *this) {
+        if (action.type == Action::OPEN) {
+            posix_spawn_file_actions_addopen(file_actions, action.fd,
+                                             action.path,
+                                             action.flags, 0666);
+        } else if (action.type == Action::DUP2) {
+            posix_spawn_file_actions_adddup2(file_actions, action.src_fd,
+                                             action.fd);
+        } else {
+            posix_spawn_file_actions_addclose(file_actions, action.fd);
+        }
+    }
+}
+
+//===========================Fork server=================================
+
+//a spawn request is a header, then len bytes of strings: the program path,
+//argc argv strings, envc environment strings, and the path of every OPEN
+//action. actions are sent as ForkAction records after the strings. the
+//header carries the fds: smash's cwd, its fds 0-2 and every DUP2 source
+//above 2, in that order
+struct ForkRequest {
+    int pgid;
+    int argc;
+    int envc;
+    int num_actions;
+    int num_fds;
+    size_t len;
+};
+
+struct ForkAction {
+    int type;
+    int fd;
+    //index into the passed fds for DUP2 sources above 2
+    int src;
+    int flags;
+};
+
+struct ForkReply {
+    int pid;
+    int err;
+};
+
+static const int FORK_MAX_FDS = 64;
+
+static bool _readAll(int fd, void* data, size_t len) {
+    char* p = (char*)data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+//send data with fds attached to its first byte
+static bool _sendWithFds(int sock, const void* data, size_t len,
+                         const int* fds, int num_fds) {
+    struct iovec iov;
+    iov.iov_base = (void*)data;
+    iov.iov_len = len;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    vector<char> control(CMSG_SPACE(sizeof(int) * FORK_MAX_FDS));
+    if (num_fds > 0) {
+        msg.msg_control = control.data();
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+    }
+    ssize_t n;
+    while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+    }
+    //whatever didn't fit, MSG_NOSIGNAL so a dead server is just an error
+    const char* rest = (const char*)data;
+    for (size_t done = n; n >= 0 && done < len; done += n > 0 ? n : 0) {
+        n = send(sock, rest + done, len - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+        }
+    }
+    return n >= 0;
+}
+
+//receive exactly len bytes, storing up to max_fds passed fds (close on exec)
+static bool _recvWithFds(int sock, void* data, size_t len, int* fds,
+                         int max_fds, int* num_fds) {
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = len;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    vector<char> control(CMSG_SPACE(sizeof(int) * max_fds));
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    if (n <= 0) {
+        return false;
+    }
+    *num_fds = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds + *num_fds, CMSG_DATA(cmsg), sizeof(int) * count);
+            *num_fds += count;
+        }
+    }
+    return _readAll(sock, (char*)data + n, len - n);
+}
+
+ForkServer::~ForkServer() {
+    if (sock != -1) {
+        //the server exits when it reads end of file
+        close(sock);
+    }
+}
 
+void ForkServer::detach() {
+    if (sock != -1) {
+        //the parent still holds the socket, the server doesn't see EOF
+        close(sock);
+        sock = -1;
+    }
+}
+
+bool ForkServer::start() {
+    int socks[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, socks) < 0) {
+        perror("smash error: socketpair failed");
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("smash error: fork failed");
+        close(socks[0]);
+        close(socks[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(socks[0]);
+        serve(socks[1]);
+        _exit(0);
+    }
+    close(socks[1]);
+    sock = socks[0];
+    return true;
+}
 
-            if(waitpid(pid, NULL, WNOHANG) < 0) {
-                perror("smash error: waitpid failed");
+int ForkServer::spawn(int* pid, const char* path, char* const argv[],
+                      const FdPlan* plan, int pgid, int* pidfd) {
+    ForkRequest request;
+    request.pgid = pgid;
+    request.argc = 0;
+    request.envc = 0;
+    request.num_actions = 0;
+
+    string strings(path, strlen(path) + 1);
+    for (; argv[request.argc] != nullptr; ++request.argc) {
+        strings.append(argv[request.argc], strlen(argv[request.argc]) + 1);
+    }
+    for (; environ[request.envc] != nullptr; ++request.envc) {
+        strings.append(environ[request.envc],
+                       strlen(environ[request.envc]) + 1);
+    }
+
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd < 0) {
+        return errno;
+    }
+    int fds[FORK_MAX_FDS] = {cwd, 0, 1, 2};
+    int num_fds = 4;
+    vector<ForkAction> actions;
+    if (plan != nullptr) {
+        for (const FdPlan::Action& action : *plan) {
+            ForkAction sent;
+            sent.type = action.type;
+            sent.fd = action.fd;
+            sent.src = action.src_fd;
+            sent.flags = action.flags;
+            if (action.type == FdPlan::Action::OPEN) {
+                strings.append(action.path, strlen(action.path) + 1);
+            } else if (action.type == FdPlan::Action::DUP2
+                       && action.src_fd > 2) {
+                if (num_fds == FORK_MAX_FDS) {
+                    close(cwd);
+                    return EMFILE;
+                }
+                sent.src = num_fds;
+                fds[num_fds++] = action.src_fd;
             }
+            actions.push_back(sent);
+        }
+    }
+    request.num_actions = actions.size();
+    request.num_fds = num_fds;
+    request.len = strings.size();
+
+    string message((const char*)&request, sizeof(request));
+    message += strings;
+    message.append((const char*)actions.data(),
+                   actions.size() * sizeof(ForkAction));
+    bool sent = _sendWithFds(sock, message.data(), message.size(), fds,
+                             num_fds);
+    close(cwd);
+
+    ForkReply reply;
+    int reply_fd = -1;
+    int num_reply_fds = 0;
+    if (!sent || !_recvWithFds(sock, &reply, sizeof(reply), &reply_fd, 1,
+                               &num_reply_fds)) {
+        //the server is gone, smash spawns for itself from now on
+        close(sock);
+        sock = -1;
+        return EPIPE;
+    }
+    if (num_reply_fds == 0) {
+        reply_fd = -1;
+    }
+    if (pidfd != nullptr) {
+        *pidfd = reply_fd;
+    } else if (reply_fd != -1) {
+        close(reply_fd);
+    }
+    *pid = reply.pid;
+    return reply.err;
+}
 
+//the child side of a spawn request, never returns
+static void _forkServerExec(const ForkRequest& request, const char* path,
+                            char* const* argv, char* const* envp,
+                            const vector<ForkAction>& actions,
+                            const vector<const char*>& open_paths,
+                            const int* fds, int err_fd) {
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, nullptr);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    size_t next_path = 0;
+    bool ok = setpgid(0, request.pgid) == 0 && fchdir(fds[0]) == 0;
+    for (int fd = 0; ok && fd < 3; ++fd) {
+        ok = dup2(fds[fd + 1], fd) == fd;
+    }
+    for (size_t i = 0; ok && i < actions.size(); ++i) {
+        const ForkAction& action = actions[i];
+        if (action.type == FdPlan::Action::OPEN) {
+            int fd = open(open_paths[next_path++], action.flags, 0666);
+            ok = fd >= 0;
+            if (ok && fd != action.fd) {
+                ok = dup2(fd, action.fd) == action.fd;
+                close(fd);
+            }
+        } else if (action.type == FdPlan::Action::DUP2) {
+            int src = action.src > 2 ? fds[action.src] : action.src;
+            ok = dup2(src, action.fd) == action.fd;
+        } else if (action.fd <= 2) {
+            //smash's own fds above 2 were never passed
+            ok = close(action.fd) == 0;
         }
-        else {
-            shell->setCurrentFGCmd(arg, pid , -1);
-            //WUNTRACED in case the child gets stopped.
-            if(waitpid(pid, NULL, WUNTRACED) < 0){
-                perror("smash error: waitpid failed");
+    }
+    if (ok) {
+        execve(path, argv, envp);
+    }
+    int err = errno;
+    if (write(err_fd, &err, sizeof(err)) < 0) {
+        _exit(127);
+    }
+    _exit(127);
+}
+
+void ForkServer::serve(int sock) {
+    //ctrl-C and ctrl-Z are smash's business, and the server goes with smash
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGALRM, SIG_DFL);
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+    while (true) {
+        ForkRequest request;
+        int fds[FORK_MAX_FDS];
+        int num_fds = 0;
+        if (!_recvWithFds(sock, &request, sizeof(request), fds, FORK_MAX_FDS,
+                          &num_fds)) {
+            return;
+        }
+        vector<char> strings(request.len);
+        vector<ForkAction> actions(request.num_actions);
+        if (!_readAll(sock, strings.data(), strings.size())
+            || !_readAll(sock, actions.data(),
+                         actions.size() * sizeof(ForkAction))) {
+            return;
+        }
+
+        //cut the strings back apart
+        vector<char*> words;
+        for (size_t i = 0; i < strings.size();
+             i += strlen(strings.data() + i) + 1) {
+            words.push_back(strings.data() + i);
+        }
+        if (words.size() < (size_t)(1 + request.argc + request.envc)) {
+            return;
+        }
+        const char* path = words[0];
+        vector<char*> argv(words.begin() + 1,
+                           words.begin() + 1 + request.argc);
+        argv.push_back(nullptr);
+        vector<char*> envp(words.begin() + 1 + request.argc,
+                           words.begin() + 1 + request.argc + request.envc);
+        envp.push_back(nullptr);
+        vector<const char*> open_paths(words.begin() + 1 + request.argc
+                                       + request.envc, words.end());
+
+        ForkReply reply;
+        reply.pid = -1;
+        reply.err = 0;
+        int pidfd = -1;
+        int err_pipe[2];
+        if (num_fds != request.num_fds || num_fds < 4) {
+            reply.err = EBADF;
+        } else if (pipe2(err_pipe, O_CLOEXEC) < 0) {
+            reply.err = errno;
+        } else {
+            //a child of smash, not of the server
+            reply.pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD,
+                                nullptr, nullptr, nullptr, nullptr);
+            if (reply.pid == 0) {
+                close(err_pipe[0]);
+                _forkServerExec(request, path, argv.data(), envp.data(),
+                                actions, open_paths, fds, err_pipe[1]);
+            }
+            if (reply.pid < 0) {
+                reply.err = errno;
+            }
+            close(err_pipe[1]);
+            //nothing to read once the exec went through
+            if (reply.pid > 0 && read(err_pipe[0], &reply.err,
+                                      sizeof(reply.err)) <= 0) {
+                reply.err = 0;
+            }
+            close(err_pipe[0]);
+            if (reply.pid > 0 && reply.err == 0) {
+                pidfd = syscall(SYS_pidfd_open, reply.pid, 0);
             }
-            else {
-                shell->setCurrentFGCmd(nullptr, -1, -1);
+        }
+        for (int i = 0; i < num_fds; ++i) {
+            close(fds[i]);
+        }
+        bool sent = _sendWithFds(sock, &reply, sizeof(reply), &pidfd,
+                                 pidfd == -1 ? 0 : 1);
+        if (pidfd != -1) {
+            close(pidfd);
+        }
+        if (!sent) {
+            return;
+        }
+    }
+}
+
+//start cmd_line (without the background sign) with the fd changes in plan,
+//in process group pgid (0 for a new group of its own).
+//simple lines are spawned directly, everything else goes through bash -c.
+//returns the child pid or -1 on failure
+static int _spawnExternal(const char* cmd_line, PathCache* cache,
+                          const FdPlan* plan = nullptr, int pgid = 0,
+                          char** argv = nullptr) {
+    //the child must not print before what we still have buffered
+    shellOut().flush();
+    Metrics* metrics = SmallShell::getInstance().getMetrics();
+    uint64_t start = Metrics::now();
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    //the shell keeps its signals blocked for the event loop, the child
+    //must not inherit that
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP
+                                    | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setsigmask(&attr, &no_signals);
+    posix_spawn_file_actions_t file_actions;
+    posix_spawn_file_actions_init(&file_actions);
+    if (plan != nullptr) {
+        plan->fillSpawnActions(&file_actions);
+    }
+
+    //a file the plan can't open fails the command whatever runs it, it
+    //must not look like a program that couldn't be exec'd
+    if (plan != nullptr && !plan->canOpen()) {
+        perror("smash error: open failed");
+        posix_spawn_file_actions_destroy(&file_actions);
+        posix_spawnattr_destroy(&attr);
+        return -1;
+    }
+
+    pid_t pid = -1;
+    ForkServer* server = SmallShell::getInstance().getForkServer();
+    auto spawn = [&](const char* path, char* const argv[]) -> int {
+        if (server->isRunning()) {
+            int err = server->spawn(&pid, path, argv, plan, pgid, nullptr);
+            //EPIPE: the server died, do it ourselves
+            if (err != EPIPE || server->isRunning()) {
+                return err;
+            }
+        }
+        return posix_spawn(&pid, path, &file_actions, &attr, argv, environ);
+    };
+
+    int err = -1;
+    if (_isSimpleCommand(cmd_line)) {
+        char* inline_argv[COMMAND_MAX_ARGS + 1];
+        if (argv == nullptr) {
+            argv = inline_argv;
+            _parseCommandLine(cmd_line, argv, COMMAND_MAX_ARGS + 1,
+                              SmallShell::getInstance().getArena());
+        }
+        string path;
+        if (argv[0] != nullptr && cache->lookup(argv[0], &path)) {
+            err = spawn(path.c_str(), argv);
+            //only a path that can't be exec'd is stale, anything else
+            //would fail the same way under bash
+            if (err == ENOENT || err == EACCES || err == ENOEXEC) {
+                cache->forget(argv[0]);
+            } else if (err != 0) {
+                errno = err;
+                perror("smash error: posix_spawn failed");
+                posix_spawn_file_actions_destroy(&file_actions);
+                posix_spawnattr_destroy(&attr);
+                return -1;
             }
         }
     }
+    if (err != 0) {
+        //let bash deal with anything we couldn't run ourselves,
+        //including reporting unknown commands
+        char* bash = (char *)"/bin/bash";
+        char* flag = (char *)"-c";
+        char* const paramlist[] = {bash, flag, (char*)cmd_line, NULL};
+        err = spawn("/bin/bash", paramlist);
+    }
+    posix_spawn_file_actions_destroy(&file_actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err != 0) {
+        errno = err;
+        //a file the plan opens is the likely culprit, bash runs anything
+        if (plan != nullptr && plan->hasOpen()) {
+            perror("smash error: open failed");
+        } else {
+            perror("smash error: posix_spawn failed");
+        }
+        return -1;
+    }
+    //posix_spawn and the fork server return once the child has exec'd
+    metrics->record(Metrics::SPAWN, start);
+    metrics->add(Metrics::FORKS);
+    TraceRing* trace = SmallShell::getInstance().getTrace();
+    trace->record(TraceRing::FORK, pid, 0, cmd_line, start);
+    trace->record(TraceRing::EXEC, pid, 0, cmd_line);
+    return pid;
+}
+
+void ExternalCommand::execute() {
+
+    //the line and its words, both without the background sign. the words
+    //are already split, the line is only copied when the sign goes
+    const char* arg = cmd_line;
+    bool isBG = _isBackgroundComamnd(cmd_line);
+    if(isBG) {
+        char* line = _arenaTrim(cmd_line, strlen(cmd_line), shell->getArena());
+        _removeBackgroundSign(line);
+        arg = line;
+        size_t last_len = strlen(args[num_args - 1]);
+        if(last_len == 1) {
+            args[--num_args] = nullptr;
+        } else {
+            args[num_args - 1][last_len - 1] = '\0';
+        }
+    }
+
+    if(isBG && jl->isFull()) {
+        cerr << "smash error: jobs list is full" << endl;
+        return;
+    }
+
+    uint64_t start = Metrics::now();
+    int pid = _spawnExternal(arg, shell->getPathCache(), plan, 0, args);
+    if (pid == -1) {
+        return;
+    }
+    if (timeout_secs > 0) {
+        shell->addTimeout(pid, job_line, timeout_secs);
+    }
 
-//    free(arg);
-//    arg = NULL;
+    if(isBG) {
+        jl->addJob(job_line, pid, false);
+    }
+    else {
+        shell->setCurrentFGCmd(timeout_secs > 0 ? job_line : arg, pid , -1);
+        int status;
+        struct rusage usage;
+        //WUNTRACED in case the child gets stopped.
+        if(shell->waitForeground(pid, WUNTRACED, &status, &usage) < 0){
+            perror("smash error: wait4 failed");
+        }
+        else {
+            shell->setCurrentFGCmd(nullptr, -1, -1);
+            if(!WIFSTOPPED(status)) {
+                shell->recordForegroundUsage(status, usage);
+                shell->getMetrics()->record(Metrics::FOREGROUND, start);
+            }
+        }
+    }
 }
 
 //===========================Built-in Implementation=================================
@@ -298,32 +1239,76 @@ void SmallShell::setLastPwd(string new_last_pwd) {
 
 //===========================Jobs List Implementation=================================
 JobsList::JobsList():jobs_list(){
+    //optional soft limit on background jobs, no limit by default
+    const char* limit = getenv("SMASH_MAX_JOBS");
+    if (limit != nullptr && atol(limit) > 0){
+        max_jobs = atol(limit);
+    }
+    exit_fd = epoll_create1(EPOLL_CLOEXEC);
 }
 
-JobsList::~JobsList() {
+void JobsList::reopenExitFd() {
+    if (exit_fd != -1) {
+        close(exit_fd);
+    }
+    //the jobs are the parent's children, there is nothing to watch yet
+    exit_fd = epoll_create1(EPOLL_CLOEXEC);
 }
 
-int JobsList::addJob(const char *cmd, int pid, bool isStopped, int jid) {
-	removeFinishedJobs();
-    if (jobs_list.size() == MAX_COMMANDS) return -1;
-    if (isStopped && jid > 0){
-        for (auto i = jobs_list.begin(); i != jobs_list.end(); ++i) {
-            if(i->jobId < jid){
-                continue;
-            }
-            //found first element with bigger job id than stopped one, insert before it
-            jobs_list.emplace(i, JobEntry(jid, cmd, pid, time(nullptr), isStopped));
-            return jid;
+JobsList::~JobsList() {
+    for (auto i = jobs_list.begin(); i != jobs_list.end(); ++i) {
+        if (i->second.pidfd != -1) {
+            close(i->second.pidfd);
         }
     }
-    if (jobs_list.empty()){
-        jobs_list.emplace_back(JobEntry(1, cmd, pid, time(nullptr), isStopped));
-        return 1;
+    if (exit_fd != -1) {
+        close(exit_fd);
+    }
+}
+
+int JobsList::sendSignal(JobEntry* je, int sig) {
+    int ret;
+    if (je->isGroup) {
+        ret = killpg(je->pid, sig);
+    } else if (je->pidfd == -1) {
+        ret = kill(je->pid, sig);
+    } else {
+        ret = syscall(SYS_pidfd_send_signal, je->pidfd, sig, nullptr, 0);
     }
-    jobs_list.emplace_back(JobEntry(jobs_list.back().jobId + 1, cmd, pid,
-                                    time(nullptr), isStopped));
+    if (ret == 0 && sig == SIGCONT) {
+        SmallShell::getInstance().getTrace()->record(
+                TraceRing::RESUME, je->pid, je->jobId, je->cmd_line.c_str());
+    }
+    return ret;
+}
 
-    return jobs_list.back().jobId + 1;
+int JobsList::addJob(const char *cmd, int pid, bool isStopped, int jid,
+                     bool isGroup) {
+    if (isFull()) {
+        return -1;
+    }
+    //a stopped foreground job gets its old id back if it had one
+    if (!(isStopped && jid > 0 && jobs_by_id.find(jid) == jobs_by_id.end())){
+        jid = jobs_list.empty() ? 1 : jobs_list.rbegin()->first + 1;
+    }
+    JobEntry* je = &jobs_list.emplace(jid, JobEntry(jid, cmd, pid,
+                                      time(nullptr), isStopped)).first->second;
+    je->isGroup = isGroup;
+    jobs_by_id[jid] = je;
+    jobs_by_pid[pid] = je;
+    //the job isn't reaped yet, so pid is still this process
+    je->pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (je->pidfd != -1 && exit_fd != -1) {
+        fcntl(je->pidfd, F_SETFD, FD_CLOEXEC);
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = pid;
+        epoll_ctl(exit_fd, EPOLL_CTL_ADD, je->pidfd, &event);
+    }
+    if (isStopped){
+        stopped_ids.insert(jid);
+    }
+    return jid;
 }
 
 static void printIdErrorMessage(int jobId, string commandType) {
@@ -336,47 +1321,143 @@ static void printIdErrorMessage(int jobId, string commandType) {
 }
 
 JobsList::JobEntry *JobsList::getJobById(int jobId) {
-    if (jobId < 1 || jobs_list.empty()) {
-        return nullptr;
-    }
-    int n = jobs_list.size();
-    for (int i = 0; i < n; ++i) {
-        if (jobs_list[i].jobId == jobId){
-            return &jobs_list[i];
-        }
-    }
-    return nullptr;
+    auto i = jobs_by_id.find(jobId);
+    return i == jobs_by_id.end() ? nullptr : i->second;
+}
+
+JobsList::JobEntry *JobsList::getJobByPid(int pid) {
+    auto i = jobs_by_pid.find(pid);
+    return i == jobs_by_pid.end() ? nullptr : i->second;
 }
 
 void JobsList::removeJobById(int jobId, string commandType) {
-    for (auto i = jobs_list.begin(); i != jobs_list.end(); i++) {
-        if (i->jobId == jobId){
-            jobs_list.erase(i);
-            return;
-        }
+    JobEntry* je = getJobById(jobId);
+    if (je == nullptr){
+        //command not found
+        printIdErrorMessage(jobId, commandType);
+        return;
+    }
+    if (je->pidfd != -1) {
+        //leaves the epoll set with it
+        close(je->pidfd);
     }
-    //command not found
-    printIdErrorMessage(jobId, commandType);
-    return;
+    jobs_by_pid.erase(je->pid);
+    stopped_ids.erase(jobId);
+    jobs_by_id.erase(jobId);
+    jobs_list.erase(jobId);
 }
 
-void JobsList::printJobsList() {
-    //empty
-    if (jobs_list.empty()) return;
-    int  n = jobs_list.size();
-    for (int i = 0; i <n; ++i) {
-        cout << &jobs_list[i];
+void JobsList::setJobStopped(JobEntry* je, bool isStopped) {
+    je->isStopped = isStopped;
+    if (isStopped){
+        stopped_ids.insert(je->jobId);
+    } else{
+        stopped_ids.erase(je->jobId);
     }
 }
 
-ostream &operator<<(ostream &out, const JobsList::JobEntry *je) {
-    out << "[" << je->jobId << "]" << " " << je->cmd_line << " : "
-        << je->pid << " " << difftime(time(nullptr), je->startTime) << " secs";
-    if (je->isStopped){
-        out << " (stopped)";
-    }
-    out << endl;
-    return out;
+static double _seconds(const struct timeval& tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void _printUsage(const struct rusage& usage) {
+    char line[160];
+    snprintf(line, sizeof(line),
+             "    user %.3fs sys %.3fs maxrss %ldkB ctxsw %ld/%ld\n",
+             _seconds(usage.ru_utime), _seconds(usage.ru_stime),
+             usage.ru_maxrss, usage.ru_nvcsw, usage.ru_nivcsw);
+    shellOut() << line;
+}
+
+void JobsList::printJobsList(bool verbose) {
+    for (auto i = jobs_list.begin(); i != jobs_list.end(); ++i) {
+        JobEntry& je = i->second;
+        shellOut() << &je;
+        if (!verbose) {
+            continue;
+        }
+        //a job that is gone already keeps whatever we knew
+        if (!readProcUsage(je.pid, &je.usage)) {
+            shellOut() << "    (exited)\n";
+        }
+        _printUsage(je.usage);
+    }
+    if (!verbose) {
+        return;
+    }
+    for (const JobEntry& je : finished) {
+        shellOut() << "[" << je.jobId << "] " << je.cmd_line << " : "
+                   << je.pid << " (";
+        if (WIFSIGNALED(je.status)) {
+            shellOut() << "killed by signal " << WTERMSIG(je.status);
+        } else {
+            shellOut() << "exit " << WEXITSTATUS(je.status);
+        }
+        shellOut() << ")\n";
+        _printUsage(je.usage);
+    }
+    finished.clear();
+}
+
+bool JobsList::readProcUsage(int pid, struct rusage* usage) {
+    char path[64];
+    char buffer[4096];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    ssize_t len = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (len <= 0) {
+        return false;
+    }
+    buffer[len] = '\0';
+    //the command name may hold spaces and parentheses, the fields we want
+    //come after its last ')'
+    char* fields = strrchr(buffer, ')');
+    unsigned long utime, stime;
+    if (fields == nullptr || sscanf(fields + 1,
+            " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+            &utime, &stime) != 2) {
+        return false;
+    }
+    long ticks = sysconf(_SC_CLK_TCK);
+    memset(usage, 0, sizeof(*usage));
+    usage->ru_utime.tv_sec = utime / ticks;
+    usage->ru_utime.tv_usec = (utime % ticks) * 1000000 / ticks;
+    usage->ru_stime.tv_sec = stime / ticks;
+    usage->ru_stime.tv_usec = (stime % ticks) * 1000000 / ticks;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return true;
+    }
+    len = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    buffer[len > 0 ? len : 0] = '\0';
+    char* line;
+    if ((line = strstr(buffer, "VmHWM:")) != nullptr) {
+        usage->ru_maxrss = strtol(line + 6, nullptr, 10);
+    }
+    if ((line = strstr(buffer, "\nvoluntary_ctxt_switches:")) != nullptr) {
+        usage->ru_nvcsw = strtol(line + 25, nullptr, 10);
+    }
+    if ((line = strstr(buffer, "nonvoluntary_ctxt_switches:")) != nullptr) {
+        usage->ru_nivcsw = strtol(line + 27, nullptr, 10);
+    }
+    return true;
+}
+
+ostream &operator<<(ostream &out, const JobsList::JobEntry *je) {
+    out << "[" << je->jobId << "]" << " " << je->cmd_line << " : "
+        << je->pid << " " << difftime(time(nullptr), je->startTime) << " secs";
+    if (je->isStopped){
+        out << " (stopped)";
+    }
+    out << "\n";
+    return out;
 }
 
 JobsList::JobEntry *JobsList::getLastJob(int *lastJobId) {
@@ -384,58 +1465,104 @@ JobsList::JobEntry *JobsList::getLastJob(int *lastJobId) {
         return nullptr;
     }
     if (lastJobId != nullptr){
-		*lastJobId = jobs_list.back().jobId;	
+		*lastJobId = jobs_list.rbegin()->first;
 	}
 	
-    return &jobs_list.back();
+    return &jobs_list.rbegin()->second;
 }
 
-/*int JobsList::getLastJobPid() {
-    for (int i = MAX_COMMANDS; i > 0 ; --i) {
-        if (jobs_list[i].jobId != 0){
-            return jobs_list[i].pid;
-        }
-    }
-    return -1;
-}*/
-
 JobsList::JobEntry *JobsList::getLastStoppedJob(int *jobId) {
-    int n = jobs_list.size();
-    for (int i = n-1; i >= 0 ; --i) {
-        if (jobs_list[i].isStopped){
-			if(jobId != nullptr){
-				*jobId = i;
-			}
-            return &jobs_list[i];
-        }
+    if (stopped_ids.empty()){
+        return nullptr;
+    }
+    int jid = *stopped_ids.rbegin();
+    if(jobId != nullptr){
+        *jobId = jid;
     }
-    return nullptr;
+    return getJobById(jid);
 }
 
 void JobsList:: killAllJobs() {
-    int n = jobs_list.size();
-    for (int i = 0; i < n; ++i) {
-        cout << jobs_list[i].pid << ": "
-             << jobs_list[i].cmd_line << endl;
-        if (kill(jobs_list[i].pid, SIGKILL) < 0){
+    for (auto i = jobs_list.begin(); i != jobs_list.end(); ++i) {
+        shellOut() << i->second.pid << ": "
+             << i->second.cmd_line << "\n";
+        if (sendSignal(&i->second, SIGKILL) < 0){
             perror("smash error: kill failed");
         }
     }
 }
 
+volatile sig_atomic_t JobsList::childChanged = 1;
+
+void JobsList::notifyChildChanged() {
+    childChanged = 1;
+}
+
+//reap whatever the SIGCHLD handler told us about. nothing to do, and no
+//syscalls, if no child changed state since the last call
 void JobsList::removeFinishedJobs() {
+    if (!childChanged) {
+        return;
+    }
+    //clear first, a child exiting while we reap raises it again
+    childChanged = 0;
+    reapExitedJobs();
+    //children that aren't jobs, or jobs without a pidfd.
+    //without WUNTRACED only exited and killed children are reported
+    int wstatus;
+    int wpid;
+    struct rusage usage;
+    while ((wpid = wait4(-1, &wstatus, WNOHANG, &usage)) > 0) {
+        finishChild(wpid, wstatus, usage);
+    }
+}
+
+void JobsList::reapExitedJobs() {
     int wstatus;
-    int n = jobs_list.size();
-    for (int i = 0; i <  n ; ++i) {
-        //test signal to see pid is still running in background
-        int wpid = waitpid(jobs_list[i].pid, &wstatus , WNOHANG);
-        if (wpid == 0) continue;
-        if ((wpid == jobs_list[i].pid &&
-             (WIFEXITED(wstatus) || WIFSIGNALED(wstatus)))
-            || (wpid == -1 && errno == ESRCH)){
-            //perror("smash error: waitpid failed");
-            removeJobById(jobs_list[i].jobId,"");
+    struct rusage usage;
+    //the pidfd keeps the pid from being reused until it is reaped here
+    struct epoll_event ready[64];
+    int num_ready = 64;
+    while (exit_fd != -1 && num_ready == 64
+           && (num_ready = epoll_wait(exit_fd, ready, 64, 0)) > 0) {
+        for (int i = 0; i < num_ready; ++i) {
+            int pid = ready[i].data.fd;
+            if (wait4(pid, &wstatus, WNOHANG, &usage) == pid) {
+                finishChild(pid, wstatus, usage);
+            } else {
+                JobEntry* je = getJobByPid(pid);
+                if (je != nullptr && je->pidfd != -1) {
+                    epoll_ctl(exit_fd, EPOLL_CTL_DEL, je->pidfd, nullptr);
+                }
+            }
+        }
+    }
+}
+
+void JobsList::finishChild(int pid, int wstatus, const struct rusage& usage) {
+    SmallShell::getInstance().getMetrics()->add(Metrics::REAPS);
+    JobEntry* je = getJobByPid(pid);
+    SmallShell::getInstance().getTrace()->record(
+            TraceRing::EXIT, pid, je != nullptr ? je->jobId : 0,
+            je != nullptr ? je->cmd_line.c_str() : nullptr, 0, wstatus);
+    if (je != nullptr) {
+        je->status = wstatus;
+        je->usage = usage;
+        finished.push_back(*je);
+        //the pidfd goes with the job
+        finished.back().pidfd = -1;
+        if (finished.size() > MAX_FINISHED) {
+            finished.pop_front();
         }
+        removeJobById(je->jobId, "");
+    }
+    SmallShell::getInstance().onChildExit(pid, wstatus);
+}
+
+void JobsList::waitForChildChange() {
+    EventLoop* events = SmallShell::getInstance().getEvents();
+    while (!childChanged && !SmallShell::interrupted) {
+        events->wait(-1);
     }
 }
 
@@ -445,8 +1572,9 @@ JobsCommand::JobsCommand(const char *cmd_line, JobsList *jobs):
 }
 
 void JobsCommand::execute() {
-    jl->removeFinishedJobs();
-    jl->printJobsList();
+    //CreateCommand already reaped, and a pipeline may run us on a thread
+    //that must not reap children the main thread is waiting for
+    jl->printJobsList(num_args > 1 && strcmp(args[1], "-v") == 0);
 }
 
 //===========================Kill cmd_line Implementation=================================
@@ -482,7 +1610,7 @@ void KillCommand::execute() {
     try{
 		jobId = stoi(args[2]);
 		sig_num = stoi(str_sig_num);
-		if (jobId < 1 || jobId > 100){
+		if (jobId < 1){
 			printIdErrorMessage(jobId, "kill");
 			return;
 		}
@@ -493,12 +1621,12 @@ void KillCommand::execute() {
 			return;
 		}
 		//send kill syscall and check for success
-		if (kill(je->pid, sig_num) < 0){
+		if (jl->sendSignal(je, sig_num) < 0){
 			perror("smash error: kill failed");
 			return;
 		} else{
-			cout << "signal number " << sig_num
-				<< " was sent to pid " << je->pid << endl;
+			shellOut() << "signal number " << sig_num
+				<< " was sent to pid " << je->pid << "\n";
 		}
 	}
 	catch (const std::exception& e) {
@@ -530,6 +1658,7 @@ void FGBGAUX(int num_args, JobsList* jl,
     const char * t_cmd_line = nullptr;
     int t_pid = 0,t_jid = 0;
     int status;
+    struct rusage usage;
     if (num_args == 1){
         if (commandType == "fg"){
             //bring job with maximal jobID to foreground
@@ -541,17 +1670,23 @@ void FGBGAUX(int num_args, JobsList* jl,
             t_cmd_line = je->cmd_line.c_str();
             t_pid = je->pid;
             t_jid = je->jobId;
-            cout << t_cmd_line << " : " << t_pid << endl;
-            smash.setCurrentFGCmd(t_cmd_line, t_pid ,t_jid);
+            shellOut() << t_cmd_line << " : " << t_pid << "\n";
+            smash.setCurrentFGCmd(t_cmd_line, t_pid ,t_jid, je->isGroup);
+            shellOut().flush();
+            //through the pidfd, which goes away with the job
+            int sent = jl->sendSignal(je, SIGCONT);
             jl->removeJobById(t_jid,"fg");
-            if (kill(t_pid,SIGCONT) < 0){
+            if (sent < 0){
                 perror("smash error: kill failed");
                 return;
             }
-            if (waitpid(t_pid, &status, WUNTRACED) < 0){
-                perror("smash error: waitpid failed");
+            if (smash.waitForeground(t_pid, WUNTRACED, &status, &usage) < 0){
+                perror("smash error: wait4 failed");
                 return;
             }
+            if (!WIFSTOPPED(status)){
+                smash.recordForegroundUsage(status, usage);
+            }
             return;
         } else if (commandType == "bg"){
             je = jl->getLastStoppedJob(nullptr);
@@ -560,12 +1695,13 @@ void FGBGAUX(int num_args, JobsList* jl,
                      << endl;
                 return;
             }
-            cout << (je->cmd_line + " : ").c_str() << je->pid << endl;
-            if (kill(je->pid,SIGCONT) < 0){
+            shellOut() << (je->cmd_line + " : ").c_str() << je->pid << "\n";
+            shellOut().flush();
+            if (jl->sendSignal(je, SIGCONT) < 0){
                 perror("smash error: kill failed");
                 return;
             }
-            je->isStopped = false;
+            jl->setJobStopped(je, false);
             return;
         }
 
@@ -581,11 +1717,12 @@ void FGBGAUX(int num_args, JobsList* jl,
                 cerr << (message).c_str() << "job-id "
                      << je->jobId << " is already running in the background"<< endl;
             } else{
-                cout << (je->cmd_line + " : ").c_str() << je->pid << endl;
-                if (kill(je->pid,SIGCONT) < 0){
+                shellOut() << (je->cmd_line + " : ").c_str() << je->pid << "\n";
+                shellOut().flush();
+            if (jl->sendSignal(je, SIGCONT) < 0){
                     perror("smash error: kill failed");
                 }
-                je->isStopped = false;
+                jl->setJobStopped(je, false);
             }
 
         } else{
@@ -593,17 +1730,22 @@ void FGBGAUX(int num_args, JobsList* jl,
             t_cmd_line = je->cmd_line.c_str();
             t_pid = je->pid;
             t_jid = je->jobId;
-            smash.setCurrentFGCmd(t_cmd_line, t_pid ,t_jid);
-            cout << t_cmd_line << " : " << t_pid << endl;
+            smash.setCurrentFGCmd(t_cmd_line, t_pid ,t_jid, je->isGroup);
+            shellOut() << t_cmd_line << " : " << t_pid << "\n";
+            shellOut().flush();
+            int sent = jl->sendSignal(je, SIGCONT);
             jl->removeJobById(t_jid, commandType);
-            if (kill(t_pid,SIGCONT) < 0){
+            if (sent < 0){
                     perror("smash error: kill failed");
                     return;
             }
-            if (waitpid(t_pid, &status, WUNTRACED) < 0){
-                perror("smash error: waitpid failed");
+            if (smash.waitForeground(t_pid, WUNTRACED, &status, &usage) < 0){
+                perror("smash error: wait4 failed");
                 return;
             }
+            if (!WIFSTOPPED(status)){
+                smash.recordForegroundUsage(status, usage);
+            }
             return;
         }
 
@@ -637,6 +1779,89 @@ void BackgroundCommand::execute() {
 
 
 
+//===========================Wait command Implementation=================================
+
+WaitCommand::WaitCommand(const char *cmd_line, SmallShell* shell)
+        : BuiltInCommand(cmd_line), shell(shell) {}
+
+void WaitCommand::execute() {
+    JobsList* jl = shell->getJobsList();
+    bool any = false;
+    vector<JobsList::JobEntry> selected;
+    for (int i = 1; i < num_args; ++i) {
+        if (strcmp(args[i], "-n") == 0) {
+            any = true;
+            continue;
+        }
+        if (strcmp(args[i], "--all") == 0) {
+            continue;
+        }
+        char* end = nullptr;
+        long jobId = strtol(args[i], &end, 10);
+        if (*end != '\0' || jobId < 1) {
+            cerr << "smash error: wait: invalid arguments" << endl;
+            return;
+        }
+        JobsList::JobEntry* je = jl->getJobById(jobId);
+        if (je == nullptr) {
+            printIdErrorMessage(jobId, "wait");
+            return;
+        }
+        selected.push_back(*je);
+    }
+    //no job ids (or --all): every job there is now
+    if (selected.empty()) {
+        int lastJobId = 0;
+        jl->getLastJob(&lastJobId);
+        for (int jobId = 1; jobId <= lastJobId; ++jobId) {
+            JobsList::JobEntry* je = jl->getJobById(jobId);
+            if (je != nullptr) {
+                selected.push_back(*je);
+            }
+        }
+    }
+    if (selected.empty()) {
+        return;
+    }
+
+    //the reaper fills in the statuses, -1 until the job is done
+    unordered_map<int, int> statuses;
+    for (const JobsList::JobEntry& je : selected) {
+        statuses[je.pid] = -1;
+    }
+    size_t left = selected.size();
+    shell->setWaited(&statuses);
+    SmallShell::interrupted = 0;
+    EventLoop* events = shell->getEvents();
+    while (left > 0 && !(any && left < selected.size())
+           && !SmallShell::interrupted) {
+        //one wait on the loop, which watches every job's pidfd at once
+        events->wait(-1);
+        JobsList::notifyChildChanged();
+        jl->removeFinishedJobs();
+        left = 0;
+        for (auto i = statuses.begin(); i != statuses.end(); ++i) {
+            if (i->second == -1) {
+                left++;
+            }
+        }
+    }
+    shell->setWaited(nullptr);
+
+    for (const JobsList::JobEntry& je : selected) {
+        int status = statuses[je.pid];
+        if (status == -1) {
+            continue;
+        }
+        shellOut() << "[" << je.jobId << "] " << je.cmd_line << " : ";
+        if (WIFSIGNALED(status)) {
+            shellOut() << "signal " << WTERMSIG(status) << "\n";
+        } else {
+            shellOut() << "exit " << WEXITSTATUS(status) << "\n";
+        }
+    }
+}
+
 //===========================Quit command Implementation=================================
 
 QuitCommand::QuitCommand(const char *cmd_line, JobsList *jobs):
@@ -650,7 +1875,7 @@ void QuitCommand::execute() {
     if (num_args > 1){
         //kill argument may be passed
         if (strcmp(args[1], "kill") == 0){
-            cout << "smash: sending SIGKILL signal to " << jl->getNumEntries()
+            shellOut() << "smash: sending SIGKILL signal to " << jl->getNumEntries()
                  << " jobs:\n";
             jl->killAllJobs();
         }
@@ -663,6 +1888,43 @@ void QuitCommand::execute() {
 
 //======================Head Implementation===============
 
+BlockReader::BlockReader(int fd, size_t block_size) : fd(fd) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            map = (char*)addr;
+            map_len = st.st_size;
+            madvise(map, map_len, MADV_SEQUENTIAL);
+            return;
+        }
+    }
+    buffer.resize(block_size);
+}
+
+BlockReader::~BlockReader() {
+    if (map != nullptr) {
+        munmap(map, map_len);
+    }
+}
+
+ssize_t BlockReader::next(const char** chunk) {
+    if (map != nullptr) {
+        if (map_done) {
+            return 0;
+        }
+        map_done = true;
+        *chunk = map;
+        return map_len;
+    }
+    ssize_t len;
+    do {
+        len = read(fd, buffer.data(), buffer.size());
+    } while (len < 0 && errno == EINTR);
+    *chunk = buffer.data();
+    return len;
+}
+
 HeadCommand::HeadCommand(const char* cmd_line)
         : BuiltInCommand(cmd_line) {
     if(num_args == 1) {
@@ -681,9 +1943,12 @@ HeadCommand::HeadCommand(const char* cmd_line)
         string temp = string(args[1]);
         temp = _trim(temp);
 
-        if(temp.length() > 1 && temp.at(0) == '-') {
+        char* end = nullptr;
+        long n = temp.length() > 1 && temp.at(0) == '-' ?
+                 strtol(temp.c_str() + 1, &end, 10) : -1;
+        if(n >= 0 && end != nullptr && *end == '\0') {
 
-            num_lines = abs(stoi(temp));
+            num_lines = n;
         }
         else {
             isFailed = true;
@@ -697,31 +1962,6 @@ HeadCommand::HeadCommand(const char* cmd_line)
     }
 }
 
-int HeadCommand::readLine(int fd, string* buffer) {
-    string str("");
-    char c;
-    int status = 1;
-
-    do {
-        status = read(fd, &c, sizeof(char));
-        if(status == -1) {
-            perror("smash error: read failed");
-            return -1;
-        }
-
-        if((size_t)status < sizeof(char)) { //we've reached EOF
-            break;
-        }
-
-        str.push_back(c);
-
-    }
-    while(c != '\n');
-
-    *buffer = str;
-    return status;
-}
-
 void HeadCommand::execute() {
 
     if(isFailed == true) {
@@ -736,378 +1976,2075 @@ void HeadCommand::execute() {
         return;
     }
 
+    shellOut().flush();
+    int out = shellOutFd();
+    BlockReader reader(fd);
     int cnt = 0;
-    int status;
-    do {
-        string buffer;
-        status = readLine(fd, &buffer);
-        if(status == -1){
-            close(fd);
-            return;
+    const char* chunk;
+    ssize_t len;
+    uint64_t bytes = 0;
+    //stop reading as soon as the last wanted newline shows up
+    while(cnt < num_lines && (len = reader.next(&chunk)) != 0) {
+        if(len == -1) {
+            perror("smash error: read failed");
+            break;
         }
-
-        cout << buffer;
-        //write(1, buffer.c_str(), buffer.length());
-
-        if(status == 0) {
-            close(fd);
-            return;
+        bytes += len;
+
+        const char* pos = chunk;
+        const char* end = chunk + len;
+        while(cnt < num_lines && pos < end) {
+            const char* nl = (const char*)memchr(pos, '\n', end - pos);
+            if(nl == nullptr) {
+                pos = end;
+                break;
+            }
+            pos = nl + 1;
+            cnt++;
         }
 
-        cnt++;
+        if(!_writeAll(out, chunk, pos - chunk)) {
+            perror("smash error: write failed");
+            break;
+        }
     }
-    while(cnt < num_lines);
+    SmallShell::getInstance().getMetrics()->add(Metrics::HEAD_BYTES, bytes);
 
     close(fd);
 }
 
-//======================RedirectionCommand Implementation===============
+//======================Timeout Implementation===============
 
-RedirectionCommand::RedirectionCommand(const char* cmd_line
-        , bool isAppend, SmallShell* shell)
-        : Command(cmd_line), isAppend(isAppend), shell(shell) {
+TimeoutCommand::TimeoutCommand(const char* cmd_line, SmallShell* shell)
+        : BuiltInCommand(cmd_line), shell(shell) {}
 
-    bool isBg = false;
-    string cmd(cmd_line);
+TimeCommand::TimeCommand(const char* cmd_line, SmallShell* shell)
+        : BuiltInCommand(cmd_line), shell(shell) {}
 
-    if(_isBackgroundComamnd(cmd_line) == true) {
-        isBg = true;
-        char* cmd_c = (char*)malloc(cmd.length()+1);
-        strcpy(cmd_c, cmd.c_str());
-        _removeBackgroundSign(cmd_c);
-        cmd = string(cmd_c);
+static void _timevalSub(struct timeval* a, const struct timeval& b) {
+    timersub(a, &b, a);
+}
 
-        free(cmd_c);
-        cmd_c = nullptr;
+//time <command>, reports on stderr like bash's time
+void TimeCommand::execute() {
+    if(num_args < 2) {
+        cerr << "smash error: time: invalid arguments" << endl;
+        return;
     }
-
-    size_t l = cmd.find_first_of(">");
-    int offset = 1;
-
-    if(isAppend == true) {
-        offset = 2;
+    const char* inner = cmd_line;
+    inner += strspn(inner, WHITESPACE.c_str());
+    inner += strcspn(inner, WHITESPACE.c_str());
+    Command* command = shell->CreateCommand(inner);
+    if(command == nullptr) {
+        return;
     }
 
-    red_cmd_args.push_back(cmd.substr(0, l));
-    red_cmd_args.push_back(cmd.substr(l+offset, cmd.length()));
-
-    if(red_cmd_args[0].empty() || red_cmd_args[1].empty()) {
-        isFailed = true;
-    }
-    else {
-        red_cmd_args[0] = _trim(red_cmd_args[0]);
-        red_cmd_args[1] = _trim(red_cmd_args[1]);
+    struct rusage self_before, self_after, usage;
+    struct timespec start, end;
+    int status = 0;
+    shell->resetForegroundUsage();
+    getrusage(RUSAGE_SELF, &self_before);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    command->execute();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    delete command;
 
-        if(isBg == true) {
-            red_cmd_args[0].append("&");
+    bool reaped = shell->getForegroundUsage(&status, &usage);
+    if(!reaped) {
+        //a built-in, or a job that went to the background or got stopped:
+        //all we can count is smash itself
+        getrusage(RUSAGE_SELF, &self_after);
+        usage = self_after;
+        _timevalSub(&usage.ru_utime, self_before.ru_utime);
+        _timevalSub(&usage.ru_stime, self_before.ru_stime);
+        usage.ru_nvcsw -= self_before.ru_nvcsw;
+        usage.ru_nivcsw -= self_before.ru_nivcsw;
+    }
+    double real = (end.tv_sec - start.tv_sec)
+                  + (end.tv_nsec - start.tv_nsec) / 1e9;
+    char report[256];
+    int len = snprintf(report, sizeof(report),
+                       "real\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\n"
+                       "maxrss\t%ldkB\nctxsw\t%ld voluntary, %ld involuntary\n",
+                       real, _seconds(usage.ru_utime), _seconds(usage.ru_stime),
+                       usage.ru_maxrss, usage.ru_nvcsw, usage.ru_nivcsw);
+    if(reaped) {
+        if(WIFSIGNALED(status)) {
+            snprintf(report + len, sizeof(report) - len, "signal\t%d\n",
+                     WTERMSIG(status));
+        } else {
+            snprintf(report + len, sizeof(report) - len, "exit\t%d\n",
+                     WEXITSTATUS(status));
         }
     }
-
+    shellOut().flush();
+    cerr << report;
 }
 
-void RedirectionCommand::execute() {
-
-    if(isFailed == true) {
-        cerr << "smash error: redirection failed" << endl;
+void TimeoutCommand::execute() {
+    char* end = nullptr;
+    long secs = num_args > 2 ? strtol(args[1], &end, 10) : 0;
+    if(secs <= 0 || *end != '\0') {
+        cerr << "smash error: timeout: invalid arguments" << endl;
         return;
     }
 
-    int fd;
-    int save_out;
-
-    if(isAppend == true) {
-        fd = open(red_cmd_args[1].c_str(), O_WRONLY | O_CREAT
-                                           | O_APPEND, 0666);
-    }
-    else {
-        fd = open(red_cmd_args[1].c_str(), O_WRONLY | O_CREAT
-                                           | O_TRUNC, 0666);
-    }
-
-    if(fd == -1) {
-        perror("smash error: open failed");
-        return;
+    //the command is the rest of the line after "timeout <secs>"
+    const char* inner = cmd_line;
+    for(int i = 0; i < 2; ++i) {
+        inner += strspn(inner, WHITESPACE.c_str());
+        inner += strcspn(inner, WHITESPACE.c_str());
     }
-
-    save_out = dup(fileno(stdout));
-
-    if(save_out == -1) {
-        perror("smash error: dup failed");
-        close(fd);
+    Command* command = shell->CreateCommand(inner);
+    if(command == nullptr) {
         return;
     }
-
-    if(dup2(fd, fileno(stdout)) == -1) {
-        perror("smash error: dup2 failed");
-        close(fd);
-        //close(save_out);
-        return;
+    //built-ins run inside smash, there is no process to kill
+    ExternalCommand* external = dynamic_cast<ExternalCommand*>(command);
+    if(external != nullptr) {
+        external->setTimeout(secs, cmd_line);
     }
-
-    Command* command = shell->CreateCommand(red_cmd_args[0].c_str());
     command->execute();
-
     delete command;
-    command = nullptr;
-
-    fflush(stdout);
-    close(fd);
+}
 
-    if(dup2(save_out, fileno(stdout)) == -1) {
-        perror("smash error: dup2 failed");
-        close(save_out);
-        return;
+//kills its process when the time is up
+class TimeoutTimer : public Timer {
+    int pid;
+    string cmd_line;
+ public:
+    TimeoutTimer(int pid, const char* cmd_line)
+            : pid(pid), cmd_line(cmd_line) {}
+    void fire() override {
+        //a child that already exited is just waiting to be reaped
+        siginfo_t info;
+        info.si_pid = 0;
+        if(waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0
+           && info.si_pid == pid) {
+            return;
+        }
+        if(kill(pid, SIGKILL) == 0) {
+            cout << "smash: got an alarm\n";
+            cout << "smash: " << cmd_line << " timed out!\n";
+        }
     }
-
-    close(save_out);
+};
+
+//======================Parallel Implementation===============
+
+ParallelRun::ParallelRun(const vector<string>& commands, size_t max_jobs,
+                         bool ordered, bool background, SmallShell* shell)
+        : commands(commands), workers(commands.size()), max_jobs(max_jobs),
+          ordered(ordered), background(background), shell(shell) {}
+
+//start command i with its stdout going to a fresh memfd
+bool ParallelRun::start(size_t i) {
+    Worker& worker = workers[i];
+    worker.out_fd = memfd_create("smash-parallel", MFD_CLOEXEC);
+    if (worker.out_fd == -1) {
+        perror("smash error: memfd_create failed");
+        return false;
+    }
+    FdPlan plan;
+    plan.addDup2(worker.out_fd, 1);
+    worker.pid = _spawnExternal(commands[i].c_str(), shell->getPathCache(),
+                                &plan);
+    if (worker.pid == -1) {
+        close(worker.out_fd);
+        worker.out_fd = -1;
+        return false;
+    }
+    by_pid[worker.pid] = i;
+    shell->getJobsList()->addJob(commands[i].c_str(), worker.pid);
+    running++;
+    return true;
 }
 
-//======================PipeCommand Implementation===============
-
-PipeCommand::PipeCommand(const char *cmd_line, SmallShell* shell,
-                         bool isError, int pos) :
-        Command(cmd_line) , isError(isError) {
-    cur_shell = shell;
-    string s = cmd_line;
-    cmd_1 = s.substr(0, pos);
-    cmd_2 = s.substr(pos + (isError?2:1),string::npos);
+void ParallelRun::fill() {
+    JobsList* jl = shell->getJobsList();
+    while (running < max_jobs && next < commands.size()) {
+        //the workers are jobs too, they wait for room under the soft
+        //limit. with none of ours running nothing would make room
+        if (jl->isFull()) {
+            if (running == 0) {
+                cerr << "smash error: jobs list is full" << endl;
+                stop();
+            }
+            break;
+        }
+        size_t i = next++;
+        if (!start(i)) {
+            //nothing to wait for, count it as finished
+            workers[i].done = true;
+        }
+    }
+    if (ordered) {
+        while (next_output < next && workers[next_output].done) {
+            printOutput(workers[next_output++]);
+        }
+    }
 }
 
-void PipeCommand::execute() {
-    cmd_1 = _trim(string(cmd_1));
-    cmd_2 = _trim(string(cmd_2));
-    char c_cmd_1[COMMAND_ARGS_MAX_LENGTH];
-    char c_cmd_2[COMMAND_ARGS_MAX_LENGTH];
-    strcpy(c_cmd_1,cmd_1.c_str());
-    strcpy(c_cmd_2,cmd_2.c_str());
-    _removeBackgroundSign(c_cmd_1);
-    _removeBackgroundSign(c_cmd_2);
-    Command* cmd1 = nullptr;
-    Command* cmd2 = nullptr;
-    char* bash = (char *)"/bin/bash";
-    char* flag = (char *)"-c";
-    string firstWordCmd1 = cmd_1.substr(0, cmd_1.find_first_of(" \n"));
-    string firstWordCmd2 = cmd_2.substr(0, cmd_2.find_first_of(" \n"));
-    if (built_in_commands.find(firstWordCmd1) != built_in_commands.end()){
-        cmd1 = cur_shell->CreateCommand(c_cmd_1);
-    }
-    if (built_in_commands.find(firstWordCmd2) != built_in_commands.end()){
-        cmd2 = cur_shell->CreateCommand(c_cmd_2);
-    }
-
-    int fd[2];
-    if (pipe(fd) < 0){
-        perror("smash error: pipe failed");
-        return;
-    }
-    int child_1 = fork();
-    if (child_1 < 0){
-        perror("smash error: fork failed");
+void ParallelRun::printOutput(Worker& worker) {
+    if (worker.out_fd == -1) {
         return;
     }
-    if (child_1 == 0) {
-        if(setpgrp() == -1){
-            perror("smash error: setpgrp failed");
-            return;
-        }
-        // first child
-        if (dup2(fd[1],isError?2:1) < 0){
-            perror("smash error: dup2 failed");
-            return;
+    shellOut().flush();
+    struct stat st;
+    if (fstat(worker.out_fd, &st) == 0) {
+        //the memfd sits at the worker's write offset, copy from the start
+        vector<char> block(1 << 16);
+        off_t offset = 0;
+        ssize_t len;
+        while (offset < st.st_size
+               && (len = pread(worker.out_fd, block.data(), block.size(),
+                               offset)) > 0) {
+            if (!_writeAll(shellOutFd(), block.data(), len)) {
+                perror("smash error: write failed");
+                break;
+            }
+            offset += len;
         }
-        if (close(fd[0]) < 0){
-            perror("smash error: close failed");
-            return;
+    }
+    close(worker.out_fd);
+    worker.out_fd = -1;
+}
+
+bool ParallelRun::onExit(int pid) {
+    auto i = by_pid.find(pid);
+    if (i == by_pid.end()) {
+        return false;
+    }
+    Worker& worker = workers[i->second];
+    by_pid.erase(i);
+    worker.done = true;
+    running--;
+    if (!ordered) {
+        printOutput(worker);
+    }
+    fill();
+    return true;
+}
+
+void ParallelRun::stop() {
+    for (size_t i = next; i < commands.size(); ++i) {
+        workers[i].done = true;
+    }
+    next = commands.size();
+    JobsList* jl = shell->getJobsList();
+    for (auto i = by_pid.begin(); i != by_pid.end(); ++i) {
+        JobsList::JobEntry* je = jl->getJobByPid(i->first);
+        if ((je != nullptr ? jl->sendSignal(je, SIGKILL)
+                           : kill(i->first, SIGKILL)) < 0) {
+            perror("smash error: kill failed");
         }
-        if (close(fd[1]) < 0){
-            perror("smash error: close failed");
-            return;
+    }
+}
+
+ParallelCommand::ParallelCommand(const char* cmd_line, SmallShell* shell)
+        : BuiltInCommand(cmd_line), shell(shell) {}
+
+//parallel [-j N] [-k] (-f file | cmd ::: cmd ...)
+void ParallelCommand::execute() {
+    bool background = _isBackgroundComamnd(cmd_line);
+    int last = num_args;
+    if (background) {
+        //the background sign may be a word of its own or stuck to the last one
+        if (strcmp(args[last - 1], "&") == 0) {
+            last--;
+        } else {
+            _removeBackgroundSign(args[last - 1]);
         }
-        //cmd 1 is not built in
-        if(cmd1 == nullptr) {
-            char* const paramlist_1[] = {bash, flag, c_cmd_1, NULL};
+    }
 
-            if (execv("/bin/bash", paramlist_1) == -1){
-                perror("smash error: execv failed");
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    bool ordered = false;
+    const char* file = nullptr;
+    int i = 1;
+    for (; i < last && args[i][0] == '-'; ++i) {
+        if (strcmp(args[i], "-k") == 0) {
+            ordered = true;
+        } else if (strcmp(args[i], "-j") == 0 && i + 1 < last) {
+            char* end = nullptr;
+            max_jobs = strtol(args[++i], &end, 10);
+            if (max_jobs <= 0 || *end != '\0') {
+                cerr << "smash error: parallel: invalid arguments" << endl;
                 return;
             }
-        }else{
-            //cmd 1 is built in
-            cmd1->execute();
-            delete cmd1;
-            cmd1 = nullptr;
-            exit(0);
-        }
-    }
-    int child_2 = fork();
-    if (child_2 < 0){
-        perror("smash error: fork failed");
-        return;
-    }
-    if (child_2 == 0) {
-        if(setpgrp() == -1){
-            perror("smash error: setpgrp failed");
+        } else if (strcmp(args[i], "-f") == 0 && i + 1 < last) {
+            file = args[++i];
+        } else {
+            cerr << "smash error: parallel: invalid arguments" << endl;
             return;
         }
-        // second child
-        if (dup2(fd[0],0) < 0){
-            perror("smash error: dup2 failed");
+    }
+
+    vector<string> commands;
+    if (file != nullptr) {
+        int fd = open(file, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            perror("smash error: open failed");
             return;
         }
-        if (close(fd[0]) < 0){
-            perror("smash error: close failed");
-            return;
+        BlockReader reader(fd);
+        string data;
+        const char* chunk;
+        ssize_t len;
+        while ((len = reader.next(&chunk)) > 0) {
+            data.append(chunk, len);
         }
-
-        if (close(fd[1]) < 0){
-            perror("smash error: close failed");
-            return;
+        close(fd);
+        size_t start = 0;
+        while (start < data.size()) {
+            size_t end = data.find('\n', start);
+            if (end == string::npos) {
+                end = data.size();
+            }
+            string line = _trim(data.substr(start, end - start));
+            if (!line.empty()) {
+                commands.push_back(line);
+            }
+            start = end + 1;
         }
-        //cmd 2 is not built in
-        if(cmd2 == nullptr) {
-            char* const paramlist_2[] = {bash, flag, c_cmd_2, NULL};
-            if (execv("/bin/bash", paramlist_2) == -1){
-                perror("smash error: execv failed");
-                return;
+    } else {
+        string command;
+        for (; i <= last; ++i) {
+            if (i == last || strcmp(args[i], ":::") == 0) {
+                if (!command.empty()) {
+                    commands.push_back(command);
+                }
+                command.clear();
+                continue;
+            }
+            if (!command.empty()) {
+                command += ' ';
             }
-        }else{
-            //cmd 2 is built in
-            cmd2->execute();
-            delete cmd2;
-            cmd2 = nullptr;
-            exit(0);
+            command += args[i];
         }
     }
-
-    if (close(fd[0]) < 0){
-        perror("smash error: close failed");
-        return;
-    }
-    if (close(fd[1]) < 0){
-        perror("smash error: close failed");
-        return;
-    }
-    if (waitpid(child_1, nullptr,0) == -1){
-        perror("smash error: waitpid failed");
+    if (commands.empty()) {
+        cerr << "smash error: parallel: invalid arguments" << endl;
         return;
     }
-    if (waitpid(child_2, nullptr,0) == -1){
-        perror("smash error: waitpid failed");
+
+    ParallelRun* run = new ParallelRun(commands, max_jobs, ordered,
+                                       background, shell);
+    shell->addParallelRun(run);
+    run->fill();
+    if (background) {
+        //reaping keeps it going and drops it once it is done, unless
+        //nothing could be started
+        if (run->done()) {
+            shell->removeParallelRun(run);
+            delete run;
+        }
         return;
     }
-    if (cmd1 != nullptr){
-        delete cmd1;
-        cmd1 = nullptr;
-    }
-}
-
-//===========================SmallShell=================================
 
-SmallShell::SmallShell()
-        : current_fg_cmd(nullptr), current_fg_cmd_pid(-1),
-          prompt("smash"), lastPwd("") {
-    jobsList = new JobsList();
-    pid = getpid();
-    if (pid < 0){
-        perror("smash error: getpid() failed");
+    JobsList* jl = shell->getJobsList();
+    SmallShell::interrupted = 0;
+    while (!run->done()) {
+        JobsList::waitForChildChange();
+        if (SmallShell::interrupted) {
+            SmallShell::interrupted = 0;
+            run->stop();
+        }
+        jl->removeFinishedJobs();
     }
-
+    shell->removeParallelRun(run);
+    delete run;
 }
 
-SmallShell::~SmallShell() {
-    delete jobsList;
-    jobsList = nullptr;
-}
+//======================Tail Implementation===============
 
-/**
-* Creates and returns a pointer to Command class which matches the given command line (cmd_line)
-*/
+const size_t TAIL_BLOCK_SIZE = 1 << 16;
 
-Command * SmallShell::CreateCommand(const char* cmd_line) {\
-    string cmd_s = _trim(string(cmd_line));
-        if (cmd_s.empty()){
-        return nullptr;
-    }
-    jobsList->removeFinishedJobs();
-    string firstWord = cmd_s.substr(0, cmd_s.find_first_of(" \n"));
-    if (firstWord.back() == '&'){
-        firstWord.pop_back();
-        if (built_in_commands.find(firstWord.c_str()) == built_in_commands.end()){
-            firstWord.push_back('&');
+TailCommand::TailCommand(const char* cmd_line)
+        : BuiltInCommand(cmd_line) {
+    for(int i = 1; i < num_args; ++i) {
+        char* end = nullptr;
+        if(strcmp(args[i], "-f") == 0) {
+            follow = true;
         }
-    }
-
-    size_t idx = ((string)cmd_line).find_first_of('>');
-    size_t idy = cmd_s.find_first_of('|');
-
-
-    if(idx != std::string::npos && idx < cmd_s.size()) {
-        bool isAppend = false;
-        if(cmd_line[idx+1] == '>') {
-            isAppend = true;
+        else if(args[i][0] == '-' && args[i][1] != '\0'
+                && (strtol(args[i] + 1, &end, 10), *end == '\0')) {
+            num_lines = atoi(args[i] + 1);
         }
-        return new RedirectionCommand(cmd_line, isAppend, this);
-    }
-    if(idy != std::string::npos && idy < cmd_s.size()) {
-        bool isError = false;
-        if(cmd_line[idy+1] == '&') {
-            isError = true;
+        else if(path.empty()) {
+            path = args[i];
+        }
+        else {
+            isFailed = true;
         }
-        return new PipeCommand(cmd_line, this, isError, idy);
     }
-    else if (firstWord.compare("chprompt") == 0) {
-        return new ChangePromptCommand(cmd_line, this);
+    if(path.empty() || isFailed) {
+        isFailed = true;
+        cerr << "smash error: tail: invalid arguments\n";
     }
-    else if (firstWord.compare("showpid") == 0) {
-        return new ShowPidCommand(cmd_line);
+}
+
+//scan backwards from the end of the file, one block at a time, for the
+//newline that ends the line before the last num_lines lines
+off_t TailCommand::findTailStart(int fd, off_t size) {
+    if(num_lines == 0) {
+        return size;
     }
-    else if (firstWord.compare("pwd") == 0) {
-        return new GetCurrDirCommand(cmd_line);
+    vector<char> block(TAIL_BLOCK_SIZE);
+    off_t end = size;
+    int cnt = 0;
+    while(end > 0) {
+        off_t start = end > (off_t)TAIL_BLOCK_SIZE ? end - TAIL_BLOCK_SIZE : 0;
+        ssize_t len = pread(fd, block.data(), end - start, start);
+        if(len < 0) {
+            perror("smash error: read failed");
+            return -1;
+        }
+        size_t search = len;
+        const char* nl;
+        while((nl = (const char*)memrchr(block.data(), '\n', search))) {
+            search = nl - block.data();
+            //the newline ending the file doesn't start another line
+            if(start + (off_t)search != size - 1 && ++cnt == num_lines) {
+                return start + search + 1;
+            }
+        }
+        end = start;
     }
-    else if (firstWord.compare("cd") == 0) {
-        return new ChangeDirCommand(cmd_line, this);
+    return 0;
+}
+
+bool TailCommand::copyRange(int fd, off_t from, off_t to) {
+    vector<char> block(TAIL_BLOCK_SIZE);
+    int out = shellOutFd();
+    while(from < to) {
+        size_t want = to - from < (off_t)block.size() ? to - from : block.size();
+        ssize_t len = pread(fd, block.data(), want, from);
+        if(len < 0) {
+            perror("smash error: read failed");
+            return false;
+        }
+        if(len == 0) {
+            break;
+        }
+        if(!_writeAll(out, block.data(), len)) {
+            perror("smash error: write failed");
+            return false;
+        }
+        from += len;
     }
-    else if (firstWord.compare("jobs") == 0) {
-        return new JobsCommand(cmd_line, jobsList);
+    return true;
+}
+
+//wait for appends with inotify and print them, until ctrl-C interrupts
+//the wait or the file goes away
+void TailCommand::followFile(int fd, off_t offset) {
+    int ifd = inotify_init1(IN_CLOEXEC);
+    if(ifd == -1) {
+        perror("smash error: inotify_init failed");
+        return;
+    }
+    if(inotify_add_watch(ifd, path.c_str(), IN_MODIFY | IN_ATTRIB
+                                             | IN_DELETE_SELF | IN_MOVE_SELF) == -1) {
+        perror("smash error: inotify_add_watch failed");
+        close(ifd);
+        return;
     }
-    else if (firstWord.compare("kill") == 0) {
-        return new KillCommand(cmd_line, jobsList);
+    char events[4096];
+    EventLoop* loop = SmallShell::getInstance().getEvents();
+    loop->watch(ifd);
+    bool gone = false;
+    SmallShell::interrupted = 0;
+    while(!gone) {
+        //other signals (SIGALRM, SIGCHLD) end the wait too
+        if(!loop->wait(ifd)) {
+            if(SmallShell::interrupted) {
+                break;
+            }
+            continue;
+        }
+        ssize_t len = read(ifd, events, sizeof(events));
+        for(ssize_t i = 0; i < len; ) {
+            const struct inotify_event* event =
+                    (const struct inotify_event*)(events + i);
+            if(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                gone = true;
+            }
+            i += sizeof(struct inotify_event) + event->len;
+        }
+        struct stat st;
+        if(fstat(fd, &st) == -1) {
+            perror("smash error: fstat failed");
+            break;
+        }
+        if(st.st_size < offset) {
+            cerr << "smash: tail: " << path << ": file truncated" << endl;
+            offset = 0;
+        }
+        if(!copyRange(fd, offset, st.st_size)) {
+            break;
+        }
+        offset = st.st_size;
+        //while we hold the file open, unlinking it only shows up as IN_ATTRIB
+        if(st.st_nlink == 0) {
+            gone = true;
+        }
     }
-    else if (firstWord.compare("fg") == 0) {
-        return new ForegroundCommand(cmd_line, jobsList);
+    loop->unwatch(ifd);
+    close(ifd);
+}
+
+void TailCommand::execute() {
+
+    if(isFailed == true) {
+        return;
     }
-    else if (firstWord.compare("bg") == 0) {
-        return new BackgroundCommand(cmd_line, jobsList);
+
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if(fd == -1) {
+        perror("smash error: open failed");
+        return;
     }
-    else if (firstWord.compare("quit") == 0) {
-        return new QuitCommand(cmd_line, jobsList);
+
+    shellOut().flush();
+    struct stat st;
+    if(fstat(fd, &st) == -1) {
+        perror("smash error: fstat failed");
+        close(fd);
+        return;
     }
-    else if(firstWord.compare("head") == 0) {
-        return new HeadCommand(cmd_line);
+
+    if(S_ISREG(st.st_mode)) {
+        off_t start = findTailStart(fd, st.st_size);
+        if(start != -1 && copyRange(fd, start, st.st_size) && follow) {
+            followFile(fd, st.st_size);
+        }
     }
     else {
-        return new ExternalCommand(cmd_line, this, jobsList);
+        //can't seek in a pipe, keep everything and cut the tail in memory
+        BlockReader reader(fd);
+        string data;
+        const char* chunk;
+        ssize_t len;
+        while((len = reader.next(&chunk)) > 0) {
+            data.append(chunk, len);
+        }
+        size_t start = data.size();
+        //the newline ending the data doesn't start another line
+        size_t search = start > 0 && data[start - 1] == '\n' ? start - 1 : start;
+        for(int cnt = 0; num_lines > 0 && search > 0; ) {
+            const char* nl = (const char*)memrchr(data.data(), '\n', search);
+            if(nl == nullptr || ++cnt == num_lines) {
+                start = nl == nullptr ? 0 : nl + 1 - data.data();
+                break;
+            }
+            search = nl - data.data();
+        }
+        if(!_writeAll(shellOutFd(), data.data() + start, data.size() - start)) {
+            perror("smash error: write failed");
+        }
     }
-    return nullptr;
+
+    close(fd);
 }
 
-void SmallShell::executeCommand(const char *cmd_line) {
+//======================RedirectionCommand Implementation===============
+
+//moves the redirections of the len bytes at cmd into plan, the targets
+//are copied to the arena. returns the rest of the line, trimmed, in the
+//arena with a spare byte for a background sign. null if a redirection
+//has no target or nothing is left
+static char* _splitRedirections(const char* cmd, size_t len, FdPlan* plan,
+                                LineArena* arena) {
+    char* inner = (char*)arena->allocate(len + 2);
+    size_t inner_len = 0;
+
+    size_t i = 0;
+    while(i < len) {
+        char c = cmd[i];
+        int fd = -1;
+        //an fd number counts only as a word of its own: 2> but not a2>
+        bool wordStart = i == 0 || _isWhitespace(cmd[i - 1]);
+        if((c == '1' || c == '2') && wordStart && i + 1 < len
+           && cmd[i + 1] == '>') {
+            fd = c - '0';
+            ++i;
+        } else if(c == '>') {
+            fd = 1;
+        } else if(c == '<') {
+            fd = 0;
+        }
+        if(fd == -1) {
+            inner[inner_len++] = c;
+            ++i;
+            continue;
+        }
+        ++i;
+
+        //2>&1
+        if(fd != 0 && i < len && cmd[i] == '&') {
+            ++i;
+            if(i >= len || cmd[i] < '0' || cmd[i] > '2') {
+                return nullptr;
+            }
+            plan->addDup2(cmd[i++] - '0', fd);
+            continue;
+        }
+
+        int flags = O_RDONLY;
+        if(fd != 0) {
+            flags = O_WRONLY | O_CREAT | O_TRUNC;
+            if(i < len && cmd[i] == '>') {
+                flags = O_WRONLY | O_CREAT | O_APPEND;
+                ++i;
+            }
+        }
+        while(i < len && _isWhitespace(cmd[i])) {
+            ++i;
+        }
+        size_t end = i;
+        while(end < len && !_isWhitespace(cmd[end])
+              && cmd[end] != '<' && cmd[end] != '>') {
+            ++end;
+        }
+        if(end == i) {
+            return nullptr;
+        }
+        plan->addOpen(fd, _arenaTrim(cmd + i, end - i, arena), flags);
+        i = end;
+    }
+
+    //trimmed in place
+    while(inner_len > 0 && _isWhitespace(inner[inner_len - 1])) {
+        --inner_len;
+    }
+    inner[inner_len] = '\0';
+    inner += strspn(inner, WHITESPACE.c_str());
+    return *inner == '\0' ? nullptr : inner;
+}
+
+RedirectionCommand::RedirectionCommand(const char* cmd_line,
+                                       SmallShell* shell)
+        : Command(cmd_line), shell(shell) {
+
+    LineArena* arena = shell->getArena();
+    bool isBg = _isBackgroundComamnd(cmd_line);
+    size_t len = strlen(cmd_line);
+    char* cmd = (char*)arena->allocate(len + 1);
+    memcpy(cmd, cmd_line, len + 1);
+    if(isBg == true) {
+        _removeBackgroundSign(cmd);
+        len = strlen(cmd);
+    }
+    inner_cmd = _splitRedirections(cmd, len, &plan, arena);
+    if(inner_cmd == nullptr) {
+        isFailed = true;
+        return;
+    }
+    if(isBg == true) {
+        strcat(inner_cmd, "&");
+    }
+}
+
+void RedirectionCommand::execute() {
+
+    if(isFailed == true) {
+        cerr << "smash error: redirection failed" << endl;
+        return;
+    }
+
+    Command* command = shell->CreateCommand(inner_cmd);
+    if(command == nullptr) {
+        return;
+    }
+
+    //the child opens the files itself, smash's fds stay as they are
+    ExternalCommand* external = dynamic_cast<ExternalCommand*>(command);
+    if(external != nullptr) {
+        external->setFdPlan(&plan);
+        command->execute();
+        delete command;
+        return;
+    }
+
+    //built-ins and pipelines print from smash or inherit its fds, so those
+    //are swapped for as long as the command runs.
+    //what was printed before the redirection belongs to the old fds
+    shellOut().flush();
+    int saved[3] = {-1, -1, -1};
+    bool ok = true;
+    for(int fd = 0; fd < 3 && ok; ++fd) {
+        if(plan.touches(fd)) {
+            saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+            if(saved[fd] == -1) {
+                perror("smash error: dup failed");
+                ok = false;
+            }
+        }
+    }
+    if(ok && plan.apply()) {
+        command->execute();
+    }
+    delete command;
+    command = nullptr;
+
+    shellOut().flush();
+    for(int fd = 0; fd < 3; ++fd) {
+        if(saved[fd] == -1) {
+            continue;
+        }
+        if(dup2(saved[fd], fd) == -1) {
+            perror("smash error: dup2 failed");
+        }
+        close(saved[fd]);
+    }
+}
+
+//======================PipeCommand Implementation===============
+
+PipeCommand::PipeCommand(const char *cmd_line, SmallShell* shell) :
+        Command(cmd_line) {
+    cur_shell = shell;
+    LineArena* arena = shell->getArena();
+    //split at every | and |&, the latter sends the stage's stderr down the pipe
+    num_stages = 1;
+    for (const char* c = strchr(cmd_line, '|'); c != nullptr;
+         c = strchr(c + 1, '|')) {
+        num_stages++;
+    }
+    stages = (Stage*)arena->allocate(num_stages * sizeof(Stage));
+    const char* start = cmd_line;
+    for (size_t i = 0; i < num_stages; ++i) {
+        Stage* stage = new (&stages[i]) Stage();
+        const char* pos = strchr(start, '|');
+        stage->cmd = _arenaTrim(start, pos == nullptr ? strlen(start)
+                                                      : pos - start, arena);
+        if (strpbrk(stage->cmd, "<>") != nullptr
+            && !_hasShellQuoting(stage->cmd)) {
+            _removeBackgroundSign(stage->cmd);
+            char* inner = _splitRedirections(stage->cmd, strlen(stage->cmd),
+                                             &stage->redirects, arena);
+            if (inner == nullptr) {
+                stage->redirectFailed = true;
+            } else {
+                stage->cmd = inner;
+            }
+        }
+        if (pos == nullptr) {
+            break;
+        }
+        stage->isError = pos[1] == '&';
+        start = pos + (stage->isError ? 2 : 1);
+    }
+}
 
+PipeCommand::~PipeCommand() {
+    for (size_t i = 0; i < num_stages; ++i) {
+        delete stages[i].built_in;
+        stages[i].built_in = nullptr;
+    }
+}
+
+//body of a thread running a built-in stage, fd is the write end of its
+//pipe or -1 for the last stage, which keeps the shell's output. writes
+//to the pipe give up once cancel_fd is signalled
+static void _runBuiltInStage(Command* cmd, int fd, int cancel_fd) {
+    //a reader that went away must give us EPIPE, not kill the whole shell
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+    if (fd == -1) {
+        cmd->execute();
+        shellOut().flush();
+        return;
+    }
+    {
+        FdWriter writer(fd, cancel_fd);
+        ostream out(&writer);
+        OutputRedirect redirect(&out, fd);
+        cmd->execute();
+        out.flush();
+        SmallShell::getInstance().getMetrics()->add(Metrics::PIPE_BYTES,
+                                                   writer.getWritten());
+    }
+    if (close(fd) < 0) {
+        perror("smash error: close failed");
+    }
+}
+
+//start stage i reading from pipe i-1 and writing to pipe i, in process
+//group pgid. returns the stage pid or -1 on failure
+int PipeCommand::startStage(size_t i, const int* pipes, size_t num_pipes,
+                            int pgid) {
+    Stage& stage = stages[i];
+    FdPlan plan;
+    if (i > 0) {
+        plan.addDup2(pipes[2 * (i - 1)], 0);
+    }
+    if (i + 1 < num_stages) {
+        plan.addDup2(pipes[2 * i + 1], stage.isError ? 2 : 1);
+    }
+    for (size_t p = 0; p < num_pipes; ++p) {
+        plan.addClose(pipes[p]);
+    }
+    plan.addAll(stage.redirects);
+
+    if (stage.built_in == nullptr) {
+        _removeBackgroundSign(stage.cmd);
+        return _spawnExternal(stage.cmd, cur_shell->getPathCache(),
+                              &plan, pgid);
+    }
+
+    //anything still buffered would be printed again by the child
+    shellOut().flush();
+    uint64_t start = Metrics::now();
+    int pid = fork();
+    if (pid < 0) {
+        perror("smash error: fork failed");
+        return -1;
+    }
+    if (pid > 0) {
+        cur_shell->getMetrics()->add(Metrics::FORKS);
+        cur_shell->getTrace()->record(TraceRing::FORK, pid, 0, stage.cmd,
+                                      start);
+    }
+    if (pid == 0) {
+        cur_shell->afterFork();
+        if (setpgid(0, pgid) == -1) {
+            perror("smash error: setpgid failed");
+        }
+        if (!plan.apply()) {
+            exit(1);
+        }
+        stage.built_in->execute();
+        shellOut().flush();
+        exit(0);
+    }
+    return pid;
+}
+
+void PipeCommand::execute() {
+    BuiltInRegistry* builtIns = cur_shell->getBuiltIns();
+    for (size_t i = 0; i < num_stages; ++i) {
+        Stage& stage = stages[i];
+        if (stage.redirectFailed) {
+            cerr << "smash error: redirection failed" << endl;
+            return;
+        }
+        if (*stage.cmd == '\0') {
+            cerr << "smash error: pipe: invalid arguments" << endl;
+            return;
+        }
+        const BuiltInRegistry::Entry* entry = builtIns->find(
+                stage.cmd, strcspn(stage.cmd, " \n&"));
+        if (entry != nullptr && entry->pipeMode != BuiltInRegistry::PIPE_EXTERNAL){
+            _removeBackgroundSign(stage.cmd);
+            stage.built_in = entry->factory(stage.cmd, cur_shell);
+            //a thread shares the shell's fds, so |& stages and stages
+            //with redirections still fork
+            stage.onThread = !stage.isError && stage.redirects.empty()
+                    && entry->pipeMode == BuiltInRegistry::PIPE_THREAD;
+        }
+    }
+
+    //all pipes are created up front, stage i writes to pipes[2i+1]
+    //and stage i+1 reads from pipes[2i]
+    int* pipes = (int*)cur_shell->getArena()->allocate(
+            2 * (num_stages - 1) * sizeof(int));
+    size_t num_pipes = 0;
+    for (size_t i = 0; i + 1 < num_stages; ++i) {
+        if (pipe(pipes + num_pipes) < 0) {
+            perror("smash error: pipe failed");
+            break;
+        }
+        num_pipes += 2;
+    }
+    bool ok = num_pipes == 2 * (num_stages - 1);
+
+    //every process joins the process group of the first one
+    int pgid = 0;
+    for (size_t i = 0; ok && i < num_stages; ++i) {
+        if (stages[i].onThread) {
+            continue;
+        }
+        stages[i].pid = startStage(i, pipes, num_pipes, pgid);
+        if (stages[i].pid == -1) {
+            ok = false;
+        } else if (pgid == 0) {
+            pgid = stages[i].pid;
+        }
+    }
+
+    //threads own the write end of their pipe and close it when done,
+    //nothing in smash reads from a pipe so every other end goes now.
+    //a thread must not block for good on a reader that gets stopped, it
+    //writes without blocking and gives up when cancel_fd is signalled
+    vector<thread> threads;
+    int cancel_fd = -1;
+    for (size_t i = 0; i < num_stages; ++i) {
+        int fd = i + 1 < num_stages && 2 * i + 1 < num_pipes ?
+                 pipes[2 * i + 1] : -1;
+        if (ok && stages[i].onThread) {
+            if (fd != -1 && cancel_fd == -1) {
+                cancel_fd = eventfd(0, EFD_CLOEXEC);
+                if (cancel_fd == -1) {
+                    perror("smash error: eventfd failed");
+                }
+            }
+            if (fd != -1 && cancel_fd != -1) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            }
+            threads.push_back(thread(_runBuiltInStage, stages[i].built_in, fd,
+                                     fd != -1 ? cancel_fd : -1));
+        } else if (fd != -1 && close(fd) < 0) {
+            perror("smash error: close failed");
+        }
+    }
+    for (size_t i = 0; i < num_pipes; i += 2) {
+        if (close(pipes[i]) < 0) {
+            perror("smash error: close failed");
+        }
+    }
+
+    //the stages are one foreground job, ctrl-C and ctrl-Z go to the
+    //whole group. threads are joined after the waits so the signals
+    //are handled meanwhile
+    if (pgid != 0) {
+        cur_shell->setCurrentFGCmd(cmd_line, pgid, -1, true);
+    }
+    for (size_t i = 0; i < num_stages; ++i) {
+        Stage& stage = stages[i];
+        if (stage.pid == -1) {
+            continue;
+        }
+        int status;
+        struct rusage usage;
+        if (cur_shell->waitForeground(stage.pid, WUNTRACED, &status,
+                                      &usage) == -1) {
+            perror("smash error: wait4 failed");
+        } else if (WIFSTOPPED(status)) {
+            //the stages left are reaped with the other children, and a
+            //thread writing to one of them stops writing
+            if (cancel_fd != -1) {
+                uint64_t one = 1;
+                if (write(cancel_fd, &one, sizeof(one)) < 0) {
+                    perror("smash error: write failed");
+                }
+            }
+            break;
+        } else {
+            cur_shell->recordForegroundUsage(status, usage);
+        }
+    }
+    cur_shell->setCurrentFGCmd(nullptr, -1, -1);
+    for (thread& worker : threads) {
+        worker.join();
+    }
+    if (cancel_fd != -1) {
+        close(cancel_fd);
+    }
+}
+
+//===========================Event loop=================================
+
+//the timerfd went off, alarmHandler fires whatever expired
+static void _expireTimers() {
+    alarmHandler(SIGALRM);
+}
+
+EventLoop::~EventLoop() {
+    if (sigfd != -1) {
+        close(sigfd);
+    }
+    if (epfd != -1) {
+        close(epfd);
+    }
+}
+
+bool EventLoop::start() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGALRM);
+    //threads started later inherit the mask, only the signalfd sees these
+    if (sigprocmask(SIG_BLOCK, &mask, nullptr) < 0) {
+        perror("smash error: sigprocmask failed");
+        return false;
+    }
+    sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sigfd == -1 || epfd == -1 || !watch(sigfd)) {
+        perror("smash error: event loop setup failed");
+        if (sigfd != -1) {
+            close(sigfd);
+            sigfd = -1;
+        }
+        if (epfd != -1) {
+            close(epfd);
+            epfd = -1;
+        }
+        //back to the handlers
+        sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+        return false;
+    }
+    watch(SmallShell::getInstance().getTimers()->getFd(), _expireTimers);
+    return true;
+}
+
+void EventLoop::stop() {
+    if (epfd == -1) {
+        return;
+    }
+    close(sigfd);
+    close(epfd);
+    sigfd = -1;
+    epfd = -1;
+    callbacks.clear();
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGALRM);
+    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+}
+
+bool EventLoop::watch(int fd, void (*onReady)()) {
+    if (epfd == -1 || fd == -1) {
+        return false;
+    }
+    struct epoll_event event;
+    event.events = onReady != nullptr ? EPOLLIN | EPOLLET : EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        return false;
+    }
+    if (onReady != nullptr) {
+        callbacks[fd] = onReady;
+    }
+    return true;
+}
+
+void EventLoop::unwatch(int fd) {
+    if (epfd != -1) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+        callbacks.erase(fd);
+    }
+}
 
+void EventLoop::dispatchSignals() {
+    struct signalfd_siginfo info[16];
+    ssize_t len;
+    while ((len = read(sigfd, info, sizeof(info))) > 0) {
+        for (size_t i = 0; i < len / sizeof(info[0]); ++i) {
+            switch (info[i].ssi_signo) {
+            case SIGINT:
+                ctrlCHandler(SIGINT);
+                break;
+            case SIGTSTP:
+                ctrlZHandler(SIGTSTP);
+                break;
+            case SIGCHLD:
+                chldHandler(SIGCHLD);
+                break;
+            case SIGALRM:
+                alarmHandler(SIGALRM);
+                break;
+            }
+        }
+    }
+}
+
+bool EventLoop::wait(int fd, int timeout_ms) {
+    if (epfd == -1) {
+        //no loop, the signal handlers interrupt the poll instead
+        struct pollfd pfd = {fd, POLLIN, 0};
+        return poll(&pfd, fd == -1 ? 0 : 1, timeout_ms) > 0;
+    }
+    struct epoll_event events[8];
+    int ready = epoll_wait(epfd, events, 8, timeout_ms);
+    bool fd_ready = false;
+    for (int i = 0; i < ready; ++i) {
+        auto callback = callbacks.find(events[i].data.fd);
+        if (events[i].data.fd == sigfd) {
+            dispatchSignals();
+        } else if (events[i].data.fd == fd) {
+            fd_ready = true;
+        } else if (callback != callbacks.end()) {
+            callback->second();
+        }
+    }
+    return fd_ready;
+}
+
+//===========================Timer wheel=================================
+
+TimerWheel::TimerWheel() {
+    for (int level = 0; level < LEVELS; ++level) {
+        for (int slot = 0; slot < SLOTS; ++slot) {
+            slots[level][slot] = nullptr;
+        }
+    }
+    origin_ns = Metrics::now();
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd == -1) {
+        perror("smash error: timerfd_create failed");
+    }
+}
+
+TimerWheel::~TimerWheel() {
+    if (tfd != -1) {
+        close(tfd);
+    }
+}
+
+unsigned long TimerWheel::ticksNow() const {
+    return (Metrics::now() - origin_ns) / (TICK_MS * 1000000ull);
+}
+
+//file a timer on the level whose slots are just wide enough to hold
+//its distance from now
+void TimerWheel::link(Timer* timer) {
+    const unsigned long max_delta = (1ul << (LEVELS * SLOT_BITS)) - 1;
+    unsigned long delta = timer->expires - now;
+    //further away than the wheel reaches, park it in the last slot and
+    //let cascading bring it back
+    unsigned long expires = delta > max_delta ? now + max_delta : timer->expires;
+    if (delta > max_delta) {
+        delta = max_delta;
+    }
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (1ul << ((level + 1) * SLOT_BITS))) {
+        level++;
+    }
+    Timer*& head = slots[level][(expires >> (level * SLOT_BITS)) & (SLOTS - 1)];
+    timer->next = head;
+    if (head != nullptr) {
+        head->pprev = &timer->next;
+    }
+    head = timer;
+    timer->pprev = &head;
+    timer->linked = true;
+}
+
+void TimerWheel::unlink(Timer* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != nullptr) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = nullptr;
+    timer->pprev = nullptr;
+    timer->linked = false;
+}
+
+unsigned long TimerWheel::nextEvent() const {
+    //level 0 holds the timers of the next SLOTS ticks
+    unsigned long event = now + SLOTS;
+    for (unsigned long tick = now + 1; tick < now + SLOTS; ++tick) {
+        if (slots[0][tick & (SLOTS - 1)] != nullptr) {
+            event = tick;
+            break;
+        }
+    }
+    //a slot of a higher level cascades when now gets to its span
+    for (int level = 1; level < LEVELS; ++level) {
+        int shift = level * SLOT_BITS;
+        unsigned long first = (now >> shift) + 1;
+        for (unsigned long span = first; span < first + SLOTS; ++span) {
+            if ((span << shift) >= event) {
+                break;
+            }
+            if (slots[level][span & (SLOTS - 1)] != nullptr) {
+                event = span << shift;
+                break;
+            }
+        }
+    }
+    return event;
+}
+
+void TimerWheel::arm() {
+    if (tfd == -1) {
+        return;
+    }
+    //all zero disarms it
+    struct itimerspec spec = {};
+    if (count > 0) {
+        uint64_t at = origin_ns + nextEvent() * (TICK_MS * 1000000ull);
+        spec.it_value.tv_sec = at / 1000000000ull;
+        spec.it_value.tv_nsec = at % 1000000000ull;
+    }
+    if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &spec, nullptr) < 0) {
+        perror("smash error: timerfd_settime failed");
+    }
+}
+
+void TimerWheel::add(Timer* timer, unsigned long delay_ms) {
+    //an empty wheel has nothing to cascade, it skips to the clock.
+    //otherwise now may lag behind, the timer is filed relative to it
+    unsigned long ticks = ticksNow();
+    if (count == 0) {
+        now = ticks;
+    }
+    //round up and count the tick in progress as gone, never fire early
+    timer->expires = ticks + (delay_ms + TICK_MS - 1) / TICK_MS + 1;
+    link(timer);
+    count++;
+    arm();
+}
+
+void TimerWheel::cancel(Timer* timer) {
+    if (timer->linked) {
+        unlink(timer);
+        //the timerfd may go off early now, expire() just re-arms it
+        if (--count == 0) {
+            arm();
+        }
+    }
+}
+
+void TimerWheel::clear() {
+    for (int level = 0; level < LEVELS; ++level) {
+        for (int slot = 0; slot < SLOTS; ++slot) {
+            for (Timer* timer = slots[level][slot]; timer != nullptr; ) {
+                Timer* next = timer->next;
+                timer->next = nullptr;
+                timer->pprev = nullptr;
+                timer->linked = false;
+                timer = next;
+            }
+            slots[level][slot] = nullptr;
+        }
+    }
+    count = 0;
+    //disarming a shared timerfd would disarm the parent's
+    if (tfd != -1) {
+        close(tfd);
+    }
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd == -1) {
+        perror("smash error: timerfd_create failed");
+    }
+}
+
+Timer* TimerWheel::advance() {
+    now++;
+    //when a level wraps, spread the next slot of the level above over it
+    for (int level = 1; level < LEVELS; ++level) {
+        if ((now & ((1ul << (level * SLOT_BITS)) - 1)) != 0) {
+            break;
+        }
+        Timer*& head = slots[level][(now >> (level * SLOT_BITS)) & (SLOTS - 1)];
+        Timer* timer = head;
+        head = nullptr;
+        while (timer != nullptr) {
+            Timer* next = timer->next;
+            link(timer);
+            timer = next;
+        }
+    }
+    Timer*& head = slots[0][now & (SLOTS - 1)];
+    Timer* expired = head;
+    head = nullptr;
+    for (Timer* timer = expired; timer != nullptr; timer = timer->next) {
+        timer->linked = false;
+        count--;
+    }
+    return expired;
+}
+
+Timer* TimerWheel::expire() {
+    //a wakeup for a timer cancelled since just finds nothing due
+    uint64_t expirations;
+    if (tfd != -1 && read(tfd, &expirations, sizeof(expirations)) < 0
+        && errno != EAGAIN) {
+        perror("smash error: read failed");
+    }
+    //only the ticks that do something are run, the others are skipped
+    unsigned long target = ticksNow();
+    Timer* expired = nullptr;
+    Timer** tail = &expired;
+    while (count > 0) {
+        unsigned long event = nextEvent();
+        if (event > target) {
+            break;
+        }
+        now = event - 1;
+        *tail = advance();
+        while (*tail != nullptr) {
+            tail = &(*tail)->next;
+        }
+    }
+    if (target > now) {
+        now = target;
+    }
+    arm();
+    return expired;
+}
+
+//===========================Metrics=================================
+
+void Histogram::record(uint64_t ns) {
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    counts[bucket < BUCKETS ? bucket : BUCKETS - 1]++;
+    count++;
+    sum_ns += ns;
+}
+
+uint64_t Histogram::percentile(double p) const {
+    uint64_t rank = (uint64_t)(p * count);
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+        seen += counts[i];
+        if (seen > rank) {
+            return 1ull << i;
+        }
+    }
+    return 1ull << (BUCKETS - 1);
+}
+
+static const char* PHASE_NAMES[Metrics::NUM_PHASES] = {
+    "parse", "execute", "spawn", "foreground"
+};
+static const char* PHASE_HELP[Metrics::NUM_PHASES] = {
+    "Time to parse a line into a command",
+    "Time to run a command, children included",
+    "Time from fork/spawn until the child has exec'd",
+    "Time from spawning a foreground command until it is reaped"
+};
+static const char* COUNTER_NAMES[Metrics::NUM_COUNTERS] = {
+    "commands", "forks", "reaps", "pipeline_bytes", "head_bytes"
+};
+static const char* COUNTER_HELP[Metrics::NUM_COUNTERS] = {
+    "Command lines run",
+    "Processes started",
+    "Children reaped",
+    "Bytes built-in pipeline stages wrote into pipes",
+    "Bytes head read"
+};
+
+Metrics::Metrics() : start_ns(now()) {
+    for (int i = 0; i < NUM_COUNTERS; ++i) {
+        counters[i].store(0);
+    }
+}
+
+uint64_t Metrics::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//ns as a short human readable duration
+static string _formatNs(uint64_t ns) {
+    char text[32];
+    if (ns < 1000) {
+        snprintf(text, sizeof(text), "%lluns", (unsigned long long)ns);
+    } else if (ns < 1000000) {
+        snprintf(text, sizeof(text), "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(text, sizeof(text), "%.1fms", ns / 1e6);
+    } else {
+        snprintf(text, sizeof(text), "%.2fs", ns / 1e9);
+    }
+    return text;
+}
+
+void Metrics::print(ostream& out) const {
+    double uptime = (now() - start_ns) / 1e9;
+    uint64_t commands = counters[COMMANDS].load();
+    for (int i = 0; i < NUM_COUNTERS; ++i) {
+        out << COUNTER_NAMES[i] << " " << counters[i].load();
+        if (i == COMMANDS && uptime > 0) {
+            char rate[32];
+            snprintf(rate, sizeof(rate), " (%.2f/s)", commands / uptime);
+            out << rate;
+        }
+        out << "\n";
+    }
+    for (int i = 0; i < NUM_PHASES; ++i) {
+        const Histogram& histogram = phases[i];
+        out << PHASE_NAMES[i] << ": count " << histogram.getCount();
+        if (histogram.getCount() > 0) {
+            //percentiles are bucket bounds, so they read as "at most"
+            out << " mean " << _formatNs(histogram.getSum()
+                                         / histogram.getCount())
+                << " p50 <" << _formatNs(histogram.percentile(0.5))
+                << " p90 <" << _formatNs(histogram.percentile(0.9))
+                << " p99 <" << _formatNs(histogram.percentile(0.99));
+        }
+        out << "\n";
+    }
+}
+
+bool Metrics::writePrometheus(const char* path) const {
+    string text;
+    char line[256];
+    for (int i = 0; i < NUM_COUNTERS; ++i) {
+        snprintf(line, sizeof(line),
+                 "# HELP smash_%s_total %s\n# TYPE smash_%s_total counter\n"
+                 "smash_%s_total %llu\n", COUNTER_NAMES[i], COUNTER_HELP[i],
+                 COUNTER_NAMES[i], COUNTER_NAMES[i],
+                 (unsigned long long)counters[i].load());
+        text += line;
+    }
+    for (int i = 0; i < NUM_PHASES; ++i) {
+        const Histogram& histogram = phases[i];
+        const char* name = PHASE_NAMES[i];
+        snprintf(line, sizeof(line),
+                 "# HELP smash_%s_seconds %s\n"
+                 "# TYPE smash_%s_seconds histogram\n",
+                 name, PHASE_HELP[i], name);
+        text += line;
+        uint64_t cumulative = 0;
+        for (int bucket = 0; bucket < Histogram::BUCKETS; ++bucket) {
+            cumulative += histogram.getBucket(bucket);
+            //skip the empty low end
+            if (cumulative == 0) {
+                continue;
+            }
+            snprintf(line, sizeof(line),
+                     "smash_%s_seconds_bucket{le=\"%.9g\"} %llu\n", name,
+                     (1ull << bucket) / 1e9, (unsigned long long)cumulative);
+            text += line;
+            if (cumulative == histogram.getCount()) {
+                break;
+            }
+        }
+        snprintf(line, sizeof(line),
+                 "smash_%s_seconds_bucket{le=\"+Inf\"} %llu\n"
+                 "smash_%s_seconds_sum %.9f\nsmash_%s_seconds_count %llu\n",
+                 name, (unsigned long long)histogram.getCount(), name,
+                 histogram.getSum() / 1e9, name,
+                 (unsigned long long)histogram.getCount());
+        text += line;
+    }
+
+    //whoever scrapes the file never sees half of it
+    string tmp = string(path) + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0666);
+    if (fd == -1) {
+        perror("smash error: open failed");
+        return false;
+    }
+    bool ok = _writeAll(fd, text.data(), text.size());
+    if (!ok) {
+        perror("smash error: write failed");
+    }
+    close(fd);
+    if (ok && rename(tmp.c_str(), path) == -1) {
+        perror("smash error: rename failed");
+        ok = false;
+    }
+    if (!ok) {
+        unlink(tmp.c_str());
+    }
+    return ok;
+}
+
+//writes the metrics out every interval, rearming itself
+class StatsDumpTimer : public Timer {
+    string path;
+    unsigned long interval_ms;
+ public:
+    StatsDumpTimer(const char* path, unsigned long interval_ms)
+            : path(path), interval_ms(interval_ms) {}
+    void fire() override {
+        SmallShell& smash = SmallShell::getInstance();
+        smash.getMetrics()->writePrometheus(path.c_str());
+        smash.getTimers()->add(this, interval_ms);
+    }
+};
+
+StatsCommand::StatsCommand(const char* cmd_line, SmallShell* shell)
+        : BuiltInCommand(cmd_line), shell(shell) {}
+
+void StatsCommand::execute() {
+    if (num_args == 1) {
+        shell->getMetrics()->print(shellOut());
+        return;
+    }
+    if (strcmp(args[1], "dump") != 0 || num_args < 3 || num_args > 4) {
+        cerr << "smash error: stats: invalid arguments" << endl;
+        return;
+    }
+    if (strcmp(args[2], "off") == 0 && num_args == 3) {
+        shell->setStatsTimer(nullptr);
+        return;
+    }
+    long secs = 0;
+    if (num_args == 4) {
+        char* end = nullptr;
+        secs = strtol(args[3], &end, 10);
+        if (secs <= 0 || *end != '\0') {
+            cerr << "smash error: stats: invalid arguments" << endl;
+            return;
+        }
+    }
+    if (!shell->getMetrics()->writePrometheus(args[2]) || secs == 0) {
+        return;
+    }
+    Timer* timer = new StatsDumpTimer(args[2], secs * 1000ul);
+    shell->setStatsTimer(timer);
+    shell->getTimers()->add(timer, secs * 1000ul);
+}
+
+//===========================Trace=================================
+
+static const char* TRACE_TYPE_NAMES[TraceRing::NUM_TYPES] = {
+    "parse", "fork", "exec", "stop", "resume", "exit"
+};
+
+TraceRing::TraceRing() {
+    for (int i = 0; i < SIZE; ++i) {
+        slots[i].seq.store(0);
+    }
+    head.store(0);
+}
+
+void TraceRing::record(Type type, int pid, int job_id, const char* name,
+                       uint64_t since_ns, int status) {
+    uint64_t now = Metrics::now();
+    uint64_t index = head.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = slots[index & (SIZE - 1)];
+    slot.seq.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    Event& event = slot.event;
+    event.ts_ns = since_ns != 0 ? since_ns : now;
+    event.dur_ns = since_ns != 0 ? now - since_ns : 0;
+    event.type = type;
+    event.pid = pid;
+    event.job_id = job_id;
+    event.status = status;
+    int len = 0;
+    //no strncpy, it isn't on the async-signal-safe list
+    while (name != nullptr && len < NAME_LENGTH - 1 && name[len] != '\0'
+           && name[len] != '\n') {
+        event.name[len] = name[len];
+        len++;
+    }
+    event.name[len] = '\0';
+    slot.seq.store(2 * (index + 1), std::memory_order_release);
+}
+
+vector<TraceRing::Event> TraceRing::snapshot() const {
+    vector<Event> events;
+    uint64_t end = head.load(std::memory_order_acquire);
+    uint64_t begin = end > (uint64_t)SIZE ? end - SIZE : 0;
+    events.reserve(end - begin);
+    for (uint64_t i = begin; i < end; ++i) {
+        const Slot& slot = slots[i & (SIZE - 1)];
+        uint64_t seq = slot.seq.load(std::memory_order_acquire);
+        if (seq != 2 * (i + 1)) {
+            continue;
+        }
+        Event copy = slot.event;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        //overwritten while we copied it
+        if (slot.seq.load(std::memory_order_relaxed) != seq) {
+            continue;
+        }
+        events.push_back(copy);
+    }
+    return events;
+}
+
+static void _appendJsonString(string& out, const char* text) {
+    out += '"';
+    for (const char* c = text; *c != '\0'; ++c) {
+        if (*c == '"' || *c == '\\') {
+            out += '\\';
+            out += *c;
+        } else if ((unsigned char)*c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", *c);
+            out += escaped;
+        } else {
+            out += *c;
+        }
+    }
+    out += '"';
+}
+
+//one Chrome trace event, a span (ph X) or an instant (ph i)
+static void _appendTraceEvent(string& out, const char* name, const char* cat,
+                              bool span, uint64_t ts_ns, uint64_t dur_ns,
+                              int lane, int pid, const char* status) {
+    char fields[256];
+    out += out.empty() ? "{\"traceEvents\": [\n" : ",\n";
+    out += "{\"name\": ";
+    _appendJsonString(out, name);
+    snprintf(fields, sizeof(fields),
+             ", \"cat\": \"%s\", \"ph\": \"%s\", \"ts\": %.3f, ",
+             cat, span ? "X" : "i", ts_ns / 1e3);
+    out += fields;
+    if (span) {
+        snprintf(fields, sizeof(fields), "\"dur\": %.3f, ", dur_ns / 1e3);
+    } else {
+        snprintf(fields, sizeof(fields), "\"s\": \"t\", ");
+    }
+    out += fields;
+    snprintf(fields, sizeof(fields),
+             "\"pid\": %d, \"tid\": %d, \"args\": {\"pid\": %d%s%s%s}}",
+             SmallShell::getInstance().getPid(), lane, pid,
+             status != nullptr ? ", \"status\": \"" : "",
+             status != nullptr ? status : "", status != nullptr ? "\"" : "");
+    out += fields;
+}
+
+bool TraceRing::writeChromeTrace(const char* path, JobsList* jobs) const {
+    vector<Event> events = snapshot();
+    //a child's lane is the job id it had at any point, later ids win
+    unordered_map<int, int> lanes;
+    unordered_map<int, string> names;
+    for (const Event& event : events) {
+        if (event.pid <= 0) {
+            continue;
+        }
+        if (event.job_id > 0) {
+            lanes[event.pid] = event.job_id;
+        }
+        if (event.name[0] != '\0') {
+            names[event.pid] = event.name;
+        }
+    }
+    //and the one it has now, for jobs that are still around
+    for (const Event& event : events) {
+        JobsList::JobEntry* je = jobs->getJobByPid(event.pid);
+        if (event.pid > 0 && je != nullptr) {
+            lanes[event.pid] = je->jobId;
+        }
+    }
+
+    string out;
+    set<int> used_lanes;
+    //a child runs from its fork until it exits, and is stopped from a
+    //stop until it is resumed
+    unordered_map<int, uint64_t> running_since;
+    unordered_map<int, uint64_t> stopped_since;
+    for (const Event& event : events) {
+        int lane = 0;
+        auto known = lanes.find(event.pid);
+        if (known != lanes.end()) {
+            lane = known->second;
+        }
+        used_lanes.insert(lane);
+        const char* name = event.name;
+        if (name[0] == '\0' && names.count(event.pid) > 0) {
+            name = names[event.pid].c_str();
+        }
+        char status[32];
+        bool has_status = event.type == EXIT;
+        if (has_status && WIFSIGNALED(event.status)) {
+            snprintf(status, sizeof(status), "signal %d",
+                     WTERMSIG(event.status));
+        } else if (has_status) {
+            snprintf(status, sizeof(status), "exit %d",
+                     WEXITSTATUS(event.status));
+        }
+        string label = string(TRACE_TYPE_NAMES[event.type]) + " " + name;
+        _appendTraceEvent(out, label.c_str(), TRACE_TYPE_NAMES[event.type],
+                          event.dur_ns > 0, event.ts_ns, event.dur_ns, lane, event.pid,
+                          has_status ? status : nullptr);
+
+        if (event.type == FORK) {
+            running_since[event.pid] = event.ts_ns;
+        } else if (event.type == STOP) {
+            stopped_since[event.pid] = event.ts_ns;
+        }
+        auto stopped = stopped_since.find(event.pid);
+        if (stopped != stopped_since.end()
+            && (event.type == RESUME || event.type == EXIT)) {
+            _appendTraceEvent(out, ("stopped " + string(name)).c_str(),
+                              "stopped", true, stopped->second,
+                              event.ts_ns - stopped->second, lane,
+                              event.pid, nullptr);
+            stopped_since.erase(stopped);
+        }
+        auto running = running_since.find(event.pid);
+        if (running != running_since.end() && event.type == EXIT) {
+            _appendTraceEvent(out, name, "run", true, running->second,
+                              event.ts_ns - running->second, lane,
+                              event.pid, has_status ? status : nullptr);
+            running_since.erase(running);
+        }
+    }
+    for (int lane : used_lanes) {
+        char meta[160];
+        string lane_name = lane == 0 ? "smash" : "job " + to_string(lane);
+        snprintf(meta, sizeof(meta),
+                 "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+                 "\"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                 SmallShell::getInstance().getPid(), lane, lane_name.c_str());
+        out += out.empty() ? "{\"traceEvents\": [\n" : ",\n";
+        out += meta;
+    }
+    out += out.empty() ? "{\"traceEvents\": [" : "\n";
+    out += "], \"displayTimeUnit\": \"ms\"}\n";
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        perror("smash error: open failed");
+        return false;
+    }
+    bool ok = _writeAll(fd, out.data(), out.size());
+    if (!ok) {
+        perror("smash error: write failed");
+    }
+    close(fd);
+    return ok;
+}
+
+TraceCommand::TraceCommand(const char* cmd_line, SmallShell* shell)
+        : BuiltInCommand(cmd_line), shell(shell) {}
+
+void TraceCommand::execute() {
+    if (num_args != 3 || strcmp(args[1], "dump") != 0) {
+        cerr << "smash error: trace: invalid arguments" << endl;
+        return;
+    }
+    shell->getTrace()->writeChromeTrace(args[2], shell->getJobsList());
+}
+
+//===========================Built-in registry=================================
+
+BuiltInRegistry::BuiltInRegistry() : table(32) {
+    add("chprompt", [](const char* cmd_line, SmallShell* shell) -> Command* {
+        return new ChangePromptCommand(cmd_line, shell);
+    });
+    add("showpid", [](const char* cmd_line, SmallShell*) -> Command* {
+        return new ShowPidCommand(cmd_line);
+    }, PIPE_THREAD);
+    add("pwd", [](const char* cmd_line, SmallShell*) -> Command* {
+        return new GetCurrDirCommand(cmd_line);
+    }, PIPE_THREAD);
+    add("cd", [](const char* cmd_line, SmallShell* shell) -> Command* {
+        return new ChangeDirCommand(cmd_line, shell);
+    });
+    //the job list changes while a pipeline is waited on, so in one it
+    //is printed by a forked copy of smash rather than a thread
+    add("jobs", [](const char* cmd_line, SmallShell* shell) -> Command* {
+        return new JobsCommand(cmd_line, shell->getJobsList());
+    });
+    add("kill", [](const char* cmd_line, SmallShell* shell) -> Command* {
+        return new KillCommand(cmd_line, shell->getJobsList());
+    });
+    add("fg", [](const char* cmd_line, SmallShell* shell) -> Command* {
+        return new ForegroundCommand(cmd_line, shell->getJobsList());
+    });
+    add("stats", [](const char* cmd_line, SmallShell* shell) -> Command* {
+        return new StatsCommand(cmd_line, shell);
+    });
+    add("trace", [](const char* cmd_line, SmallShell* shell) -> Command* {
+        return new TraceCommand(cmd_line, shell);
+    });
+    add("wait", [](const char* cmd_line, SmallShell* shell) -> Command* {
+        return new WaitCommand(cmd_line, shell);
+    });
+    add("bg", [](const char* cmd_line, SmallShell* shell) -> Command* {
+        return new BackgroundCommand(cmd_line, shell->getJobsList());
+    });
+    add("quit", [](const char* cmd_line, SmallShell* shell) -> Command* {
+        return new QuitCommand(cmd_line, shell->getJobsList());
+    });
+    add("hash", [](const char* cmd_line, SmallShell* shell) -> Command* {
+        return new HashCommand(cmd_line, shell->getPathCache());
+    });
+    //in a pipeline these read stdin, which only the real programs do
+    add("head", [](const char* cmd_line, SmallShell*) -> Command* {
+        return new HeadCommand(cmd_line);
+    }, PIPE_EXTERNAL);
+    add("tail", [](const char* cmd_line, SmallShell*) -> Command* {
+        return new TailCommand(cmd_line);
+    }, PIPE_EXTERNAL);
+    add("timeout", [](const char* cmd_line, SmallShell* shell) -> Command* {
+        return new TimeoutCommand(cmd_line, shell);
+    });
+    add("parallel", [](const char* cmd_line, SmallShell* shell) -> Command* {
+        return new ParallelCommand(cmd_line, shell);
+    });
+}
+
+//FNV-1a
+size_t BuiltInRegistry::hash(const char* name, size_t len) {
+    size_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+void BuiltInRegistry::insert(const Entry& entry) {
+    size_t mask = table.size() - 1;
+    for (size_t i = hash(entry.name, entry.len) & mask; ; i = (i + 1) & mask) {
+        if (table[i].name == nullptr) {
+            table[i] = entry;
+            count++;
+            return;
+        }
+        if (table[i].len == entry.len
+            && memcmp(table[i].name, entry.name, entry.len) == 0) {
+            table[i] = entry;
+            return;
+        }
+    }
+}
+
+void BuiltInRegistry::add(const char* name, CommandFactory factory,
+                          PipeMode pipeMode) {
+    if (2 * (count + 1) > table.size()) {
+        vector<Entry> old(2 * table.size());
+        old.swap(table);
+        count = 0;
+        for (const Entry& entry : old) {
+            if (entry.name != nullptr) {
+                insert(entry);
+            }
+        }
+    }
+    Entry entry;
+    entry.name = name;
+    entry.len = strlen(name);
+    entry.factory = factory;
+    entry.pipeMode = pipeMode;
+    insert(entry);
+}
+
+const BuiltInRegistry::Entry* BuiltInRegistry::find(const char* name,
+                                                    size_t len) const {
+    size_t mask = table.size() - 1;
+    for (size_t i = hash(name, len) & mask; ; i = (i + 1) & mask) {
+        if (table[i].name == nullptr) {
+            return nullptr;
+        }
+        if (table[i].len == len && memcmp(table[i].name, name, len) == 0) {
+            return &table[i];
+        }
+    }
+}
+
+//===========================SmallShell=================================
+
+SmallShell::SmallShell()
+        : current_fg_cmd(""), has_fg_cmd(false), current_fg_cmd_pid(-1),
+          current_fg_is_group(false), prompt("smash"), lastPwd("") {
+    jobsList = new JobsList();
+    pid = getpid();
+    if (pid < 0){
+        perror("smash error: getpid() failed");
+    }
+
+}
+
+SmallShell::~SmallShell() {
+    delete jobsList;
+    jobsList = nullptr;
+}
+
+/**
+* Creates and returns a pointer to Command class which matches the given command line (cmd_line)
+*/
+
+Command * SmallShell::CreateCommand(const char* cmd_line) {
+    const char* start = cmd_line + strspn(cmd_line, WHITESPACE.c_str());
+    if (*start == '\0'){
+        return nullptr;
+    }
+    //lines that come in together never wait on the loop, so the
+    //signals, timers and exits pending by now are handled here
+    events.wait(-1, 0);
+    jobsList->removeFinishedJobs();
+
+    size_t len = strcspn(start, WHITESPACE.c_str());
+    //time covers the rest of the line, pipes and redirections included
+    if (len == 4 && strncmp(start, "time", 4) == 0) {
+        return new TimeCommand(cmd_line, this);
+    }
+
+    //each stage of a pipeline takes its own redirections
+    if(strchr(start, '|') != nullptr) {
+        return new PipeCommand(cmd_line, this);
+    }
+    if(strpbrk(start, "<>") != nullptr) {
+        //a quoted < or > may not be a redirection at all, bash decides
+        if (_hasShellQuoting(start)) {
+            return new ExternalCommand(cmd_line, this, jobsList);
+        }
+        return new RedirectionCommand(cmd_line, this);
+    }
+
+    const BuiltInRegistry::Entry* entry = builtIns.find(start, len);
+    //a built-in may have the background sign stuck to it
+    if (entry == nullptr && start[len - 1] == '&'){
+        entry = builtIns.find(start, len - 1);
+    }
+    if (entry != nullptr){
+        return entry->factory(cmd_line, this);
+    }
+    return new ExternalCommand(cmd_line, this, jobsList);
+}
+
+void SmallShell::executeCommand(const char *cmd_line) {
+
+    uint64_t start = Metrics::now();
     Command* cmd = CreateCommand(cmd_line);
+    metrics.record(Metrics::PARSE, start);
+    trace.record(TraceRing::PARSE, 0, 0, cmd_line, start);
 
     if(cmd != nullptr) {
+        start = Metrics::now();
         cmd->execute();
+        metrics.record(Metrics::EXECUTE, start);
+        metrics.add(Metrics::COMMANDS);
     }
 
     delete cmd;
     cmd = nullptr;
+    arena.reset();
+
+    //a script only needs its output written when the buffer fills
+    if(interactive) {
+        shellOut().flush();
+    }
 }
 
-void SmallShell::setCurrentFGCmd(const char* cmd, int pid, int jid) {
-    current_fg_cmd = cmd;
+void SmallShell::setCurrentFGCmd(const char* cmd, int pid, int jid,
+                                 bool group) {
+    //keep a copy, the job the line came from may be removed while it runs
+    has_fg_cmd = cmd != nullptr;
+    current_fg_cmd.assign(has_fg_cmd ? cmd : "");
     current_fg_cmd_pid = pid;
     current_fg_cmd_jid = jid;
+    current_fg_is_group = group;
+}
+
+int SmallShell::signalCurrentFG(int sig) {
+    return current_fg_is_group ? killpg(current_fg_cmd_pid, sig)
+                               : kill(current_fg_cmd_pid, sig);
+}
+
+volatile sig_atomic_t SmallShell::interrupted = 0;
+
+void SmallShell::setStatsTimer(Timer* timer) {
+    if (statsTimer != nullptr) {
+        timers.cancel(statsTimer);
+        delete statsTimer;
+    }
+    statsTimer = timer;
+}
+
+void SmallShell::afterFork() {
+    forkServer.detach();
+    timers.clear();
+    jobsList->reopenExitFd();
+    //an epoll set and signalfd made by the parent never wake this process
+    if (events.isRunning()) {
+        events.stop();
+        events.start();
+    }
+}
+
+void SmallShell::addTimeout(int pid, const char* cmd_line, int secs) {
+    Timer* timer = new TimeoutTimer(pid, cmd_line);
+    timeouts[pid] = timer;
+    timers.add(timer, secs * 1000ul);
+}
+
+void SmallShell::clearTimeout(int pid) {
+    auto i = timeouts.find(pid);
+    if (i == timeouts.end()) {
+        return;
+    }
+    timers.cancel(i->second);
+    delete i->second;
+    timeouts.erase(i);
+}
+
+void SmallShell::resetForegroundUsage() {
+    fg_reaped = false;
+    fg_status = 0;
+    memset(&fg_usage, 0, sizeof(fg_usage));
+}
+
+void SmallShell::recordForegroundUsage(int status,
+                                       const struct rusage& usage) {
+    fg_reaped = true;
+    //a pipeline's status is its last stage's, which is reaped last
+    fg_status = status;
+    timeradd(&fg_usage.ru_utime, &usage.ru_utime, &fg_usage.ru_utime);
+    timeradd(&fg_usage.ru_stime, &usage.ru_stime, &fg_usage.ru_stime);
+    fg_usage.ru_maxrss = max(fg_usage.ru_maxrss, usage.ru_maxrss);
+    fg_usage.ru_nvcsw += usage.ru_nvcsw;
+    fg_usage.ru_nivcsw += usage.ru_nivcsw;
+}
+
+bool SmallShell::getForegroundUsage(int* status, struct rusage* usage) {
+    if (!fg_reaped) {
+        return false;
+    }
+    *status = fg_status;
+    *usage = fg_usage;
+    return true;
+}
+
+void SmallShell::addParallelRun(ParallelRun* run) {
+    parallelRuns.push_back(run);
+}
+
+void SmallShell::removeParallelRun(ParallelRun* run) {
+    parallelRuns.erase(std::remove(parallelRuns.begin(), parallelRuns.end(),
+                                   run), parallelRuns.end());
+}
+
+void SmallShell::onChildExit(int pid, int status) {
+    clearTimeout(pid);
+    if (waited != nullptr) {
+        auto i = waited->find(pid);
+        if (i != waited->end()) {
+            i->second = status;
+        }
+    }
+    for (size_t i = 0; i < parallelRuns.size(); ++i) {
+        ParallelRun* run = parallelRuns[i];
+        if (!run->onExit(pid)) {
+            continue;
+        }
+        //a foreground run is dropped by the parallel command waiting on it
+        if (run->isBackground() && run->done()) {
+            parallelRuns.erase(parallelRuns.begin() + i);
+            delete run;
+        }
+        break;
+    }
+}
+
+int SmallShell::waitForeground(int pid, int options, int* status,
+                               struct rusage* usage) {
+    int ret;
+    while (events.isRunning()
+           && (ret = wait4(pid, status, options | WNOHANG, usage)) == 0) {
+        //its SIGCHLD wakes us up, any other signal is handled meanwhile.
+        //background jobs that finish meanwhile are done with right away
+        events.wait(-1);
+        jobsList->reapExitedJobs();
+    }
+    if (!events.isRunning()) {
+        while ((ret = wait4(pid, status, options, usage)) < 0
+               && errno == EINTR) {
+        }
+    }
+    if (ret == pid && !WIFSTOPPED(*status)) {
+        metrics.add(Metrics::REAPS);
+        trace.record(TraceRing::EXIT, pid, 0, nullptr, 0, *status);
+        //its timeout goes, and a parallel worker brought back with fg
+        //lets its run go on
+        onChildExit(pid, *status);
+    }
+    return ret;
 }
 
 int SmallShell::getCurrentFGCmdPid() {
@@ -1115,7 +4052,7 @@ int SmallShell::getCurrentFGCmdPid() {
 }
 
 
-void SmallShell::addStoppedJob() {
-    jobsList->addJob(current_fg_cmd, current_fg_cmd_pid, true ,
-                     current_fg_cmd_jid);
+int SmallShell::addStoppedJob() {
+    return jobsList->addJob(current_fg_cmd.c_str(), current_fg_cmd_pid, true ,
+                     current_fg_cmd_jid, current_fg_is_group);
 }
@@ -2,27 +2,118 @@
 #define SMASH_COMMAND_H_
 
 #include <vector>
+#include <map>
+#include <deque>
+#include <set>
+#include <unordered_map>
 #include <string.h>
 #include <time.h>
+#include <signal.h>
 #include <iostream>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <stdint.h>
+#include <atomic>
 
-#define COMMAND_ARGS_MAX_LENGTH (200)
 #define COMMAND_MAX_ARGS (20)
-#define MAX_COMMANDS (100)
 
 using namespace std;
 class JobsList;
 class SmallShell;
 
+//buffered writer for a raw fd, lets a built-in print into a pipe
+class FdWriter : public streambuf {
+    int fd;
+    int cancel_fd;
+    char buffer[4096];
+    uint64_t written = 0;
+ protected:
+    int overflow(int c) override;
+    streamsize xsputn(const char* data, streamsize len) override;
+    int sync() override;
+ public:
+  //with a cancel_fd, fd must be non-blocking. a write that has to wait
+  //gives up once cancel_fd becomes readable
+  explicit FdWriter(int fd, int cancel_fd = -1);
+  ~FdWriter();
+  int getFd() const {
+      return fd;
+  }
+  //bytes that made it to fd so far
+  uint64_t getWritten() const {
+      return written;
+  }
+};
+
+//the stream built-ins print to, cout unless the calling thread was
+//pointed somewhere else
+ostream& shellOut();
+
+//the fd behind shellOut(), for built-ins that write raw data themselves.
+//flush shellOut() before writing to it
+int shellOutFd();
+
+//points shellOut() of the calling thread at out, which writes to fd,
+//until destroyed
+class OutputRedirect {
+    ostream* saved;
+    int saved_fd;
+ public:
+  OutputRedirect(ostream* out, int fd);
+  ~OutputRedirect();
+};
+
+//hands out the contents of a file in large chunks. regular files are
+//mapped whole, anything else is read block by block into one buffer
+class BlockReader {
+    int fd;
+    char* map = nullptr;
+    size_t map_len = 0;
+    bool map_done = false;
+    vector<char> buffer;
+ public:
+  explicit BlockReader(int fd, size_t block_size = 1 << 16);
+  ~BlockReader();
+  //points *chunk at the next piece of the file and returns its length,
+  //0 at end of file and -1 on a read error. a chunk stays valid until
+  //the next call
+  ssize_t next(const char** chunk);
+};
+
+//bump allocator for memory that lives as long as one command line.
+//blocks are kept across reset() so steady state does no heap allocation
+class LineArena {
+    vector<char*> blocks;
+    size_t current = 0;
+    size_t offset = 0;
+    //allocations too big for a block, freed on reset()
+    vector<char*> large;
+ public:
+  static const size_t BLOCK_SIZE = 1 << 16;
+  LineArena() = default;
+  LineArena(LineArena const&) = delete;
+  void operator=(LineArena const&) = delete;
+  ~LineArena();
+  void* allocate(size_t size);
+  void reset();
+};
+
 class Command {
 protected:
 	const char* cmd_line;
     int num_args = 0;
-    char* args[COMMAND_MAX_ARGS];
+    //points at inline_args, or at a bigger array in the line arena for
+    //lines with more than COMMAND_MAX_ARGS words
+    char** args;
+    char* inline_args[COMMAND_MAX_ARGS + 1];
  public:
   Command(const char* cmd_line);
   virtual ~Command();
   virtual void execute() = 0;
+  //commands live in the line arena like their words, delete only runs
+  //the destructor and the memory goes when the arena is reset
+  static void* operator new(size_t size);
+  static void operator delete(void*) {}
 
   const char* getCommandLine(){
       return cmd_line;
@@ -40,37 +131,172 @@ class BuiltInCommand : public Command {
 };
 
 
+class PathCache {
+ public:
+  class Entry {
+  public:
+      string path;
+      int hits = 0;
+      //index of the PATH directory the command was found in
+      size_t dir_index = 0;
+  };
+
+ private:
+    unordered_map<string, Entry> entries;
+    string path_env;
+    vector<string> dirs;
+    vector<struct timespec> dir_mtimes;
+    time_t last_check = 0;
+    void validate();
+ public:
+  PathCache() = default;
+  ~PathCache() = default;
+  bool lookup(const char* name, string* path);
+  void forget(const char* name);
+  void clear();
+  void printEntries();
+};
+
+//file descriptor changes to apply in a child before it runs its command
+class FdPlan {
+ public:
+  class Action {
+  public:
+      enum Type {DUP2, CLOSE, OPEN};
+      Type type;
+      int fd;
+      int src_fd;
+      //for OPEN, the file is opened with flags and becomes fd
+      const char* path;
+      int flags;
+  };
+
+ private:
+    static const size_t INLINE_ACTIONS = 8;
+    //points at inline_actions, or at a bigger array in the line arena
+    Action* actions;
+    size_t num_actions = 0;
+    size_t capacity = INLINE_ACTIONS;
+    Action inline_actions[INLINE_ACTIONS];
+    void add(const Action& action);
+ public:
+  FdPlan() : actions(inline_actions) {}
+  FdPlan(FdPlan const&) = delete;
+  void operator=(FdPlan const&) = delete;
+  ~FdPlan() = default;
+  void addDup2(int src_fd, int fd);
+  void addClose(int fd);
+  //path isn't copied, it must live as long as the plan
+  void addOpen(int fd, const char* path, int flags);
+  //every action of other, after the ones already here
+  void addAll(const FdPlan& other);
+  bool empty() const {
+      return num_actions == 0;
+  }
+  bool hasOpen() const;
+  //opens and closes every file of the plan, false with errno set if one
+  //can't be opened
+  bool canOpen() const;
+  const Action* begin() const {
+      return actions;
+  }
+  const Action* end() const {
+      return actions + num_actions;
+  }
+  //true if the plan changes what fd refers to
+  bool touches(int fd) const;
+  //for forked children, returns false if an action failed
+  bool apply() const;
+  void fillSpawnActions(posix_spawn_file_actions_t* file_actions) const;
+};
+
+//optional helper process, started while smash is still small, that starts
+//external commands for it (SMASH_FORK_SERVER=1). process creation then
+//costs the same however much memory smash grows to. the children are
+//cloned with CLONE_PARENT, so they are still smash's own to wait for
+class ForkServer {
+    //unix socket to the server, -1 when there is none
+    int sock = -1;
+    static void serve(int sock);
+ public:
+  ForkServer() = default;
+  ~ForkServer();
+  bool start();
+  bool isRunning() const {
+      return sock != -1;
+  }
+  //in a forked copy of smash: the server's children would be the
+  //parent's, so this copy stops using it. the server keeps running
+  void detach();
+  //like posix_spawn: 0 or an errno value. the child's fds 0-2 are smash's
+  //current ones before plan is applied. a pidfd for the child is stored
+  //in pidfd unless it is null
+  int spawn(int* pid, const char* path, char* const argv[],
+            const FdPlan* plan, int pgid, int* pidfd);
+};
+
 class ExternalCommand : public Command { 
  private:
 	SmallShell* shell;
 	JobsList* jl;
+	//set by timeout, the line shown for the job is then the whole
+	//timeout command
+	int timeout_secs = 0;
+	const char* job_line;
+	//redirections, applied in the child only
+	const FdPlan* plan = nullptr;
  public:
 	ExternalCommand(const char *cmd_line, SmallShell* shell, JobsList *jobs);
 	virtual ~ExternalCommand() {}
+	void setTimeout(int secs, const char* timeout_line);
+	void setFdPlan(const FdPlan* fd_plan) {
+		plan = fd_plan;
+	}
 	void execute() override;
 };
 
 class PipeCommand : public Command {
+ public:
+  class Stage {
+  public:
+      //trimmed copy in the line arena, without its redirections
+      char* cmd = nullptr;
+      //the stage's own redirections, applied after the pipes
+      FdPlan redirects;
+      bool redirectFailed = false;
+      //true if the stage was followed by |& and sends stderr down the pipe
+      bool isError = false;
+      //set for built-in stages, which run inside smash
+      Command* built_in = nullptr;
+      //built-ins that leave the shell alone run on a thread instead of a fork
+      bool onThread = false;
+      int pid = -1;
+  };
+
+ private:
     SmallShell* cur_shell;
-    bool isError;
-    int pos;
-    string cmd_1;
-    string cmd_2;
+    //in the line arena
+    Stage* stages;
+    size_t num_stages = 0;
+    int startStage(size_t i, const int* pipes, size_t num_pipes, int pgid);
  public:
-  PipeCommand(const char* cmd_line, SmallShell* shell, bool isError, int pos);
-  virtual ~PipeCommand() {}
+  PipeCommand(const char* cmd_line, SmallShell* shell);
+  virtual ~PipeCommand();
   void execute() override;
 };
 
+//cmd with any of >, >>, <, 2>, 2>> and 2>&1. the redirections become an
+//fd plan that an external command gets in its child, smash's own fds are
+//only swapped around built-ins and pipelines
 class RedirectionCommand : public Command {
  private: 
 	bool isFailed = false;
-	bool isAppend;
 	SmallShell* shell;
-	char path[COMMAND_ARGS_MAX_LENGTH];
-	vector<string> red_cmd_args;
+	//the line without its redirections, in the line arena
+	char* inner_cmd = nullptr;
+	FdPlan plan;
  public:
-  explicit RedirectionCommand(const char* cmd_line, bool isAppend, SmallShell* shell);
+  explicit RedirectionCommand(const char* cmd_line, SmallShell* shell);
   virtual ~RedirectionCommand() {}
   void execute() override;
   //void prepare() override;
@@ -123,23 +349,78 @@ class JobsList {
       int pid;
       time_t  startTime;
       bool isStopped;
+      //wait status and resource usage, filled in when the job is reaped
+      //and read from /proc while it is still around
+      int status = 0;
+      struct rusage usage{};
+      //refers to this very process even after its pid is reused, -1 if
+      //the kernel has no pidfds
+      int pidfd = -1;
+      //a stopped pipeline, pid is its process group and signals go to
+      //every stage
+      bool isGroup = false;
       friend ostream & operator << (ostream &out, const JobEntry*je);
   };
 
 private:
-    vector<JobEntry> jobs_list;
+    //ordered by job id for printing, nodes never move so the indexes
+    //below can point into it
+    map<int, JobEntry> jobs_list;
+    unordered_map<int, JobEntry*> jobs_by_id;
+    unordered_map<int, JobEntry*> jobs_by_pid;
+    set<int> stopped_ids;
+    //jobs reaped since the last jobs -v, oldest first, kept so it can
+    //still show how they ended
+    deque<JobEntry> finished;
+    static const size_t MAX_FINISHED = 64;
+    //soft limit on the number of jobs, 0 for none (SMASH_MAX_JOBS)
+    size_t max_jobs = 0;
+    //set from the SIGCHLD handler when there is something to reap
+    static volatile sig_atomic_t childChanged;
+    //epoll set of the jobs' pidfds, a pidfd is readable once its job exited
+    int exit_fd = -1;
+    //bookkeeping for a reaped child
+    void finishChild(int pid, int wstatus, const struct rusage& usage);
  public:
   JobsList();
   ~JobsList();
   int getNumEntries(){
       return jobs_list.size();
   }
-  int addJob(const char *cmd, int pid, bool isStopped = false, int jid = 0);
-  void printJobsList();
+  bool isFull(){
+      return max_jobs != 0 && jobs_list.size() >= max_jobs;
+  }
+  //returns the job id, or -1 once the soft limit is reached. callers
+  //check isFull() first, while they can still turn the job away
+  int addJob(const char *cmd, int pid, bool isStopped = false, int jid = 0,
+             bool isGroup = false);
+  //verbose adds each job's cpu time, max rss and context switches, and
+  //the jobs that finished since the last verbose listing with their
+  //exit status
+  void printJobsList(bool verbose = false);
+  //usage of a live process, from /proc/<pid>/stat and /proc/<pid>/status
+  static bool readProcUsage(int pid, struct rusage* usage);
   void killAllJobs();
   void removeFinishedJobs();
+  static void notifyChildChanged();
+  //reap only the jobs whose pidfds say they exited, never another child,
+  //so it is safe while a foreground child is being waited for
+  void reapExitedJobs();
+  //in a forked copy of smash: the epoll set is shared with the parent,
+  //this copy gets an empty one of its own
+  void reopenExitFd();
+  //readable when a job exited, for the event loop
+  int getExitFd() const {
+      return exit_fd;
+  }
+  //signal a job through its pidfd, returns like kill
+  int sendSignal(JobEntry* je, int sig);
+  //sleep until a child changed state or ctrl-C was pressed
+  static void waitForChildChange();
   JobEntry *getJobById(int jobId);
+  JobEntry *getJobByPid(int pid);
   void removeJobById(int jobId, string commandType);
+  void setJobStopped(JobEntry* je, bool isStopped);
   JobEntry * getLastJob(int* lastJobId);
   JobEntry *getLastStoppedJob(int *jobId);
 
@@ -182,6 +463,34 @@ class BackgroundCommand : public BuiltInCommand {
   void execute() override;
 };
 
+//wait [-n] [--all] [job-id...]: block until the jobs are done (or, with
+//-n, until one of them is) and print how each one ended
+class WaitCommand : public BuiltInCommand {
+    SmallShell* shell;
+ public:
+  WaitCommand(const char* cmd_line, SmallShell* shell);
+  virtual ~WaitCommand() {}
+  void execute() override;
+};
+
+//stats: print the metrics. stats dump <file> [secs]: write them in
+//Prometheus format, every secs seconds if given. stats dump off: stop
+class StatsCommand : public BuiltInCommand {
+    SmallShell* shell;
+ public:
+  StatsCommand(const char* cmd_line, SmallShell* shell);
+  virtual ~StatsCommand() {}
+  void execute() override;
+};
+
+class TraceCommand : public BuiltInCommand {
+    SmallShell* shell;
+ public:
+  TraceCommand(const char* cmd_line, SmallShell* shell);
+  virtual ~TraceCommand() {}
+  void execute() override;
+};
+
 class QuitCommand : public BuiltInCommand {
     JobsList* jl;
     // TODO: Add your data members public:
@@ -191,28 +500,359 @@ public:
     void execute() override;
 };
 
+class HashCommand : public BuiltInCommand {
+    PathCache* cache;
+ public:
+  HashCommand(const char* cmd_line, PathCache* cache);
+  virtual ~HashCommand() {}
+  void execute() override;
+};
+
 class HeadCommand : public BuiltInCommand {
  private:
 	int num_lines = 10;
 	string path;
 	bool isFailed = false;
-	int readLine(int fd, string* buffer);
  public:
 	HeadCommand(const char* cmd_line);
 	virtual ~HeadCommand() {}
 	void execute() override;
 };
 
+class TimeCommand : public BuiltInCommand {
+	SmallShell* shell;
+ public:
+	TimeCommand(const char* cmd_line, SmallShell* shell);
+	virtual ~TimeCommand() {}
+	void execute() override;
+};
+
+class TimeoutCommand : public BuiltInCommand {
+	SmallShell* shell;
+ public:
+	TimeoutCommand(const char* cmd_line, SmallShell* shell);
+	virtual ~TimeoutCommand() {}
+	void execute() override;
+};
+
+//the state of one parallel built-in: its commands go to at most max_jobs
+//workers at a time, a new one starting whenever one is reaped. each
+//worker's stdout is kept in a memfd and printed whole once it is done
+class ParallelRun {
+ public:
+  class Worker {
+  public:
+      int pid = -1;
+      int out_fd = -1;
+      bool done = false;
+  };
+
+ private:
+    vector<string> commands;
+    vector<Worker> workers;
+    unordered_map<int, size_t> by_pid;
+    size_t next = 0;
+    size_t running = 0;
+    size_t next_output = 0;
+    size_t max_jobs;
+    //print outputs in the order of the commands, not as they finish
+    bool ordered;
+    bool background;
+    SmallShell* shell;
+    bool start(size_t i);
+    void printOutput(Worker& worker);
+ public:
+  ParallelRun(const vector<string>& commands, size_t max_jobs, bool ordered,
+              bool background, SmallShell* shell);
+  ~ParallelRun() = default;
+  void fill();
+  //true if pid was one of our workers
+  bool onExit(int pid);
+  //don't start anything new and kill what is running
+  void stop();
+  bool done() const {
+      return next == commands.size() && running == 0;
+  }
+  bool isBackground() const {
+      return background;
+  }
+};
+
+class ParallelCommand : public BuiltInCommand {
+	SmallShell* shell;
+ public:
+	ParallelCommand(const char* cmd_line, SmallShell* shell);
+	virtual ~ParallelCommand() {}
+	void execute() override;
+};
+
+class TailCommand : public BuiltInCommand {
+ private:
+	int num_lines = 10;
+	bool follow = false;
+	string path;
+	bool isFailed = false;
+	off_t findTailStart(int fd, off_t size);
+	bool copyRange(int fd, off_t from, off_t to);
+	void followFile(int fd, off_t offset);
+ public:
+	TailCommand(const char* cmd_line);
+	virtual ~TailCommand() {}
+	void execute() override;
+};
+
+//an entry in the timer wheel. fire() runs from the event loop once the
+//wheel's timerfd goes off
+class Timer {
+ public:
+  Timer* next = nullptr;
+  //the pointer that points at this timer, for O(1) unlinking
+  Timer** pprev = nullptr;
+  unsigned long expires = 0;
+  bool linked = false;
+  Timer() = default;
+  virtual ~Timer() {}
+  virtual void fire() = 0;
+};
+
+//where the shell blocks. SIGINT, SIGTSTP, SIGCHLD and SIGALRM are blocked
+//and read from a signalfd in an epoll set with stdin, the timer wheel's
+//timerfd and whatever else a command waits on, so their handlers run in
+//normal context and never in the middle of a command
+class EventLoop {
+    int epfd = -1;
+    int sigfd = -1;
+    unordered_map<int, void (*)()> callbacks;
+ public:
+  EventLoop() = default;
+  ~EventLoop();
+  bool start();
+  //closes the fds and unblocks the signals, back to the handlers
+  void stop();
+  bool isRunning() const {
+      return epfd != -1;
+  }
+  //false if fd can't be waited on (a regular file is always ready).
+  //with onReady the fd is edge triggered and onReady runs on each change,
+  //it should only note what has to be done
+  bool watch(int fd, void (*onReady)() = nullptr);
+  void unwatch(int fd);
+  //run the handlers of the signals that came in
+  void dispatchSignals();
+  //block until fd is readable (true), or until signals were handled or
+  //timeout_ms passed (false). fd must be watched, or -1 for signals only
+  bool wait(int fd, int timeout_ms = -1);
+};
+
+//hierarchical timer wheel behind one timerfd, which the event loop
+//watches. the timerfd is armed for the next tick that expires or
+//cascades something, never while the wheel is empty, so an idle shell
+//isn't woken up. adding and cancelling a timer is O(1)
+class TimerWheel {
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    Timer* slots[LEVELS][SLOTS];
+    //last tick handled, ticks are counted from origin_ns
+    unsigned long now = 0;
+    size_t count = 0;
+    int tfd = -1;
+    uint64_t origin_ns;
+    unsigned long ticksNow() const;
+    void link(Timer* timer);
+    void unlink(Timer* timer);
+    //first tick after now that expires or cascades a timer
+    unsigned long nextEvent() const;
+    void arm();
+    //one tick, returns the timers that expired on it
+    Timer* advance();
+ public:
+  static const int TICK_MS = 100;
+  TimerWheel();
+  TimerWheel(TimerWheel const&) = delete;
+  void operator=(TimerWheel const&) = delete;
+  ~TimerWheel();
+  int getFd() const {
+      return tfd;
+  }
+  //the wheel doesn't own timers, they stay valid until cancelled
+  void add(Timer* timer, unsigned long delay_ms);
+  //no-op for a timer that already fired
+  void cancel(Timer* timer);
+  //drop every timer without firing it, they stay valid and unlinked.
+  //the timerfd is replaced, a forked child shares the parent's
+  void clear();
+  //once the timerfd is readable, catch up to the clock. returns the
+  //expired timers chained through next
+  Timer* expire();
+};
+
+//counts of durations in log2 buckets, bucket i holds values below 2^i ns.
+//recording is a clz and two adds
+class Histogram {
+ public:
+  static const int BUCKETS = 48;
+ private:
+  uint64_t counts[BUCKETS] = {};
+  uint64_t count = 0;
+  uint64_t sum_ns = 0;
+ public:
+  void record(uint64_t ns);
+  uint64_t getCount() const {
+      return count;
+  }
+  uint64_t getSum() const {
+      return sum_ns;
+  }
+  uint64_t getBucket(int i) const {
+      return counts[i];
+  }
+  //upper bound of the bucket the p-th fraction of the values falls in
+  uint64_t percentile(double p) const;
+};
+
+//smash's own overhead: how long each step of running a line takes, and
+//counters. histograms are only recorded on the main thread, counters may
+//be bumped from pipeline threads
+class Metrics {
+ public:
+  enum Phase {PARSE, EXECUTE, SPAWN, FOREGROUND, NUM_PHASES};
+  enum Counter {COMMANDS, FORKS, REAPS, PIPE_BYTES, HEAD_BYTES,
+                NUM_COUNTERS};
+ private:
+  Histogram phases[NUM_PHASES];
+  std::atomic<uint64_t> counters[NUM_COUNTERS];
+  uint64_t start_ns;
+ public:
+  Metrics();
+  Metrics(Metrics const&) = delete;
+  void operator=(Metrics const&) = delete;
+  //monotonic ns
+  static uint64_t now();
+  void record(Phase phase, uint64_t since_ns) {
+      phases[phase].record(now() - since_ns);
+  }
+  void add(Counter counter, uint64_t n = 1) {
+      counters[counter].fetch_add(n, std::memory_order_relaxed);
+  }
+  void print(ostream& out) const;
+  //Prometheus text format, written to a temporary file and renamed
+  bool writePrometheus(const char* path) const;
+};
+
+//what happened to which child when: the last SIZE events, the oldest
+//overwritten first. record takes no locks and doesn't allocate, so the
+//signal handlers can call it
+class TraceRing {
+ public:
+  enum Type {PARSE, FORK, EXEC, STOP, RESUME, EXIT, NUM_TYPES};
+  //a power of two
+  static const int SIZE = 4096;
+  static const int NAME_LENGTH = 48;
+  class Event {
+  public:
+      uint64_t ts_ns;
+      //0 for an instant
+      uint64_t dur_ns;
+      Type type;
+      int pid;
+      //0 when the event doesn't know it
+      int job_id;
+      //wait status, for EXIT
+      int status;
+      char name[NAME_LENGTH];
+  };
+ private:
+  class Slot {
+  public:
+      //odd while the event is written, 2 * (index + 1) once it is done
+      std::atomic<uint64_t> seq;
+      Event event;
+  };
+  Slot slots[SIZE];
+  std::atomic<uint64_t> head;
+ public:
+  TraceRing();
+  TraceRing(TraceRing const&) = delete;
+  void operator=(TraceRing const&) = delete;
+  //an instant now, or a span from since_ns until now. name is truncated
+  void record(Type type, int pid, int job_id, const char* name,
+              uint64_t since_ns = 0, int status = 0);
+  //the events still in the ring, oldest first, skipping any being written
+  vector<Event> snapshot() const;
+  //Chrome trace JSON, one lane per job id
+  bool writeChromeTrace(const char* path, JobsList* jobs) const;
+};
+
+typedef Command* (*CommandFactory)(const char* cmd_line, SmallShell* shell);
+
+//name -> factory table for the built-ins, shared by CreateCommand and
+//PipeCommand. open addressing keyed on the raw bytes of the first word,
+//so a lookup needs no std::string
+class BuiltInRegistry {
+ public:
+  //how a built-in behaves as a pipeline stage
+  enum PipeMode {
+      PIPE_EXTERNAL, //run the program of the same name instead
+      PIPE_FORK,     //run the built-in in a forked copy of smash
+      PIPE_THREAD    //only prints, and reads nothing the shell changes,
+                     //run it on a thread inside smash
+  };
+  class Entry {
+  public:
+      const char* name = nullptr;
+      size_t len = 0;
+      CommandFactory factory = nullptr;
+      PipeMode pipeMode = PIPE_FORK;
+  };
+
+ private:
+    //size is a power of two, kept at most half full
+    vector<Entry> table;
+    size_t count = 0;
+    static size_t hash(const char* name, size_t len);
+    void insert(const Entry& entry);
+ public:
+  BuiltInRegistry();
+  ~BuiltInRegistry() = default;
+  //name must outlive the registry. replaces an existing entry
+  void add(const char* name, CommandFactory factory,
+           PipeMode pipeMode = PIPE_FORK);
+  const Entry* find(const char* name, size_t len) const;
+};
+
 class SmallShell {
 
  private:
-    const char * current_fg_cmd;
+    string current_fg_cmd;
+    bool has_fg_cmd;
     int current_fg_cmd_pid;
+    //current_fg_cmd_pid is a process group, a foreground pipeline
+    bool current_fg_is_group;
      int current_fg_cmd_jid;
      JobsList* jobsList;
      string prompt;
      string lastPwd;
      int pid;
+     PathCache pathCache;
+     LineArena arena;
+     BuiltInRegistry builtIns;
+     bool interactive = true;
+     TimerWheel timers;
+     ForkServer forkServer;
+     EventLoop events;
+     //timeout timers by the pid they kill
+     unordered_map<int, Timer*> timeouts;
+     vector<ParallelRun*> parallelRuns;
+     unordered_map<int, int>* waited = nullptr;
+     Metrics metrics;
+     TraceRing trace;
+     //the periodic stats dump, if one is set up
+     Timer* statsTimer = nullptr;
+     //what the foreground children reaped since resetForegroundUsage used
+     bool fg_reaped = false;
+     int fg_status = 0;
+     struct rusage fg_usage{};
     SmallShell();
  public:
  //JobsList* jobsList;
@@ -234,18 +874,82 @@ class SmallShell {
       return pid;
 	}
   void setLastPwd(string new_last_pwd);
-  void setCurrentFGCmd(const char* cmd, int pid, int jid);
+  //group when pid is the process group of a pipeline
+  void setCurrentFGCmd(const char* cmd, int pid, int jid, bool group = false);
   const char* getCurrentFGCmdLine(){
-        return current_fg_cmd;
+        return has_fg_cmd ? current_fg_cmd.c_str() : nullptr;
     }
     int getCurrentFGCmdPid();
     int getCurrentFGCmdJid(){
         return current_fg_cmd_jid;
     }
-    void addStoppedJob();
+    bool isCurrentFGGroup(){
+        return current_fg_is_group;
+    }
+    //the foreground command, or its whole process group
+    int signalCurrentFG(int sig);
+    //returns the job id it got
+    int addStoppedJob();
     JobsList* getJobsList(){
         return jobsList;
     }
+    PathCache* getPathCache(){
+        return &pathCache;
+    }
+    LineArena* getArena(){
+        return &arena;
+    }
+    BuiltInRegistry* getBuiltIns(){
+        return &builtIns;
+    }
+    bool isInteractive(){
+        return interactive;
+    }
+    void setInteractive(bool is_interactive){
+        interactive = is_interactive;
+    }
+    Metrics* getMetrics(){
+        return &metrics;
+    }
+    TraceRing* getTrace(){
+        return &trace;
+    }
+    //replaces any periodic dump before it, null for none
+    void setStatsTimer(Timer* timer);
+    //in a forked copy of smash that goes on to run a built-in. the
+    //parent's fork server, timers, event loop and job notifications stay
+    //the parent's
+    void afterFork();
+    EventLoop* getEvents(){
+        return &events;
+    }
+    //wait4 for a foreground child, handling ctrl-C, ctrl-Z and alarms
+    //while it runs
+    int waitForeground(int pid, int options, int* status,
+                       struct rusage* usage);
+    ForkServer* getForkServer(){
+        return &forkServer;
+    }
+    TimerWheel* getTimers(){
+        return &timers;
+    }
+    void addTimeout(int pid, const char* cmd_line, int secs);
+    //forget the timeout of a child that is gone
+    void clearTimeout(int pid);
+    void resetForegroundUsage();
+    //add a reaped foreground child, a pipeline adds one per stage
+    void recordForegroundUsage(int status, const struct rusage& usage);
+    bool getForegroundUsage(int* status, struct rusage* usage);
+    void addParallelRun(ParallelRun* run);
+    void removeParallelRun(ParallelRun* run);
+    //bookkeeping for a reaped child that isn't about the jobs list
+    void onChildExit(int pid, int status);
+    //while a wait built-in runs, the exit statuses of the pids it waits for
+    void setWaited(unordered_map<int, int>* statuses) {
+        waited = statuses;
+    }
+    //set by the ctrl-C handler, for built-ins that wait on their own
+    static volatile sig_atomic_t interrupted;
 
 };
 
@@ -0,0 +1,278 @@
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include "Commands.h"
+#include "signals.h"
+
+//microbenchmarks for smash's hot paths. prints one JSON object with the
+//percentiles of every benchmark to stdout, everything smash itself prints
+//while running goes to /dev/null.
+//usage: smash_bench [path to smash, for the smash vs bash runs]
+
+using namespace std;
+
+extern char** environ;
+int _parseCommandLine(const char* cmd_line, char**& args, int capacity,
+                      LineArena* arena);
+
+static int json_fd = -1;
+static bool first_result = true;
+
+static double _now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//samples are in unit, already scaled
+static void report(const string& name, const string& unit,
+                   vector<double> samples) {
+    if (samples.empty()) {
+        return;
+    }
+    sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (double sample : samples) {
+        sum += sample;
+    }
+    auto pct = [&samples](double p) {
+        return samples[min(samples.size() - 1,
+                           (size_t)(p * samples.size()))];
+    };
+    char line[512];
+    int len = snprintf(line, sizeof(line),
+                       "%s\n    {\"name\": \"%s\", \"unit\": \"%s\", "
+                       "\"samples\": %zu, \"mean\": %.3f, \"min\": %.3f, "
+                       "\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, "
+                       "\"max\": %.3f}",
+                       first_result ? "" : ",", name.c_str(), unit.c_str(),
+                       samples.size(), sum / samples.size(), samples.front(),
+                       pct(0.5), pct(0.9), pct(0.99), samples.back());
+    first_result = false;
+    if (write(json_fd, line, len) != len) {
+        perror("smash_bench: write failed");
+    }
+}
+
+static void benchParse() {
+    const char* lines[] = {
+        "ls",
+        "sleep 100 &",
+        "cp -r /some/long/source/path /another/long/destination/path",
+        "a b c d e f g h i j k l m n o p q r s t u v w x y z",
+    };
+    const char* names[] = {"parse_1_word", "parse_background",
+                           "parse_3_words", "parse_26_words"};
+    LineArena arena;
+    for (size_t l = 0; l < sizeof(lines) / sizeof(lines[0]); ++l) {
+        vector<double> samples;
+        for (int i = 0; i < 100000; ++i) {
+            char* inline_args[COMMAND_MAX_ARGS + 1];
+            char** args = inline_args;
+            double start = _now();
+            _parseCommandLine(lines[l], args, COMMAND_MAX_ARGS + 1, &arena);
+            samples.push_back(_now() - start);
+            arena.reset();
+        }
+        report(names[l], "ns", samples);
+    }
+}
+
+static void benchCreateCommand() {
+    SmallShell& smash = SmallShell::getInstance();
+    const char* lines[] = {"pwd", "/bin/true", "ls | wc -l", "echo hi > f"};
+    const char* names[] = {"create_builtin", "create_external",
+                           "create_pipe", "create_redirection"};
+    for (size_t l = 0; l < sizeof(lines) / sizeof(lines[0]); ++l) {
+        vector<double> samples;
+        for (int i = 0; i < 100000; ++i) {
+            double start = _now();
+            Command* cmd = smash.CreateCommand(lines[l]);
+            delete cmd;
+            smash.getArena()->reset();
+            samples.push_back(_now() - start);
+        }
+        report(names[l], "ns", samples);
+    }
+}
+
+//fork/exec of an external command until it is reaped
+static void benchExternal() {
+    SmallShell& smash = SmallShell::getInstance();
+    const char* lines[] = {"/bin/true", "true", "/bin/true 'quoted'"};
+    const char* names[] = {"external_direct", "external_path_lookup",
+                           "external_via_bash"};
+    for (size_t l = 0; l < sizeof(lines) / sizeof(lines[0]); ++l) {
+        vector<double> samples;
+        for (int i = 0; i < 500; ++i) {
+            double start = _now();
+            smash.executeCommand(lines[l]);
+            samples.push_back((_now() - start) / 1e3);
+        }
+        report(names[l], "us", samples);
+    }
+}
+
+//MB/s through a whole pipeline
+static void benchPipe() {
+    SmallShell& smash = SmallShell::getInstance();
+    const size_t mb = 256;
+    string line = "head -c " + to_string(mb << 20) + " /dev/zero | cat";
+    vector<double> samples;
+    for (int i = 0; i < 10; ++i) {
+        double start = _now();
+        smash.executeCommand(line.c_str());
+        samples.push_back(mb / ((_now() - start) / 1e9));
+    }
+    report("pipe_throughput", "MB/s", samples);
+}
+
+//MB/s of the head built-in printing a whole large file
+static void benchHead() {
+    char path[] = "/tmp/smash_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("smash_bench: mkstemp failed");
+        return;
+    }
+    string block;
+    for (int i = 0; i < 16384; ++i) {
+        block += "a line of text in a large file that head has to scan\n";
+    }
+    size_t size = 0;
+    while (size < (256u << 20)) {
+        if (write(fd, block.data(), block.size()) != (ssize_t)block.size()) {
+            perror("smash_bench: write failed");
+            break;
+        }
+        size += block.size();
+    }
+    close(fd);
+
+    SmallShell& smash = SmallShell::getInstance();
+    string line = string("head -1000000000 ") + path;
+    vector<double> samples;
+    for (int i = 0; i < 10; ++i) {
+        double start = _now();
+        smash.executeCommand(line.c_str());
+        samples.push_back((size >> 20) / ((_now() - start) / 1e9));
+    }
+    report("head_throughput", "MB/s", samples);
+    unlink(path);
+}
+
+//add, look up and remove with n jobs in the table, per operation
+static void benchJobs(int n) {
+    JobsList jobs;
+    vector<double> add, by_id, by_pid, last_stopped, remove;
+    //fake pids, nothing is ever signalled or reaped here
+    const int base_pid = 1 << 22;
+    double start;
+    for (int i = 0; i < n; ++i) {
+        start = _now();
+        jobs.addJob("sleep 100", base_pid + i, i % 2 == 0);
+        add.push_back(_now() - start);
+    }
+    for (int i = 0; i < n; ++i) {
+        start = _now();
+        jobs.getJobById(i + 1);
+        by_id.push_back(_now() - start);
+        start = _now();
+        jobs.getJobByPid(base_pid + i);
+        by_pid.push_back(_now() - start);
+        start = _now();
+        jobs.getLastStoppedJob(nullptr);
+        last_stopped.push_back(_now() - start);
+    }
+    for (int i = 0; i < n; ++i) {
+        start = _now();
+        jobs.removeJobById(i + 1, "");
+        remove.push_back(_now() - start);
+    }
+    string suffix = "_" + to_string(n);
+    report("jobs_add" + suffix, "ns", add);
+    report("jobs_get_by_id" + suffix, "ns", by_id);
+    report("jobs_get_by_pid" + suffix, "ns", by_pid);
+    report("jobs_last_stopped" + suffix, "ns", last_stopped);
+    report("jobs_remove" + suffix, "ns", remove);
+}
+
+//wall time of a whole shell running the same lines, smash against bash
+static void benchShells(const char* smash_path) {
+    string lines;
+    for (int i = 0; i < 100; ++i) {
+        lines += "/bin/true\n";
+    }
+    for (int i = 0; i < 20; ++i) {
+        lines += "echo x | cat\n";
+    }
+    const char* shells[][2] = {{smash_path, "smash"}, {"/bin/bash", "bash"}};
+    for (auto& shell : shells) {
+        if (access(shell[0], X_OK) != 0) {
+            continue;
+        }
+        vector<double> samples;
+        for (int i = 0; i < 20; ++i) {
+            char* argv[] = {(char*)shell[0], (char*)"-c",
+                            (char*)lines.c_str(), nullptr};
+            double start = _now();
+            int pid;
+            if (posix_spawn(&pid, shell[0], nullptr, nullptr, argv,
+                            environ) != 0) {
+                perror("smash_bench: posix_spawn failed");
+                break;
+            }
+            waitpid(pid, nullptr, 0);
+            samples.push_back((_now() - start) / 1e6);
+        }
+        report(string("script_") + shell[1], "ms", samples);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const char* smash_path = argc > 1 ? argv[1] : "./smash";
+    if (signal(SIGCHLD, chldHandler) == SIG_ERR) {
+        perror("smash_bench: failed to set SIGCHLD handler");
+    }
+    //foreground waits go through the event loop like in smash
+    SmallShell::getInstance().getEvents()->start();
+    std::ios::sync_with_stdio(false);
+    std::cout.rdbuf(new FdWriter(1));
+
+    //keep the real stdout for the results, the rest goes nowhere
+    json_fd = dup(1);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (json_fd == -1 || null_fd == -1 || dup2(null_fd, 1) == -1) {
+        perror("smash_bench: failed to redirect stdout");
+        return 1;
+    }
+    close(null_fd);
+    SmallShell::getInstance().setInteractive(false);
+
+    const char* header = "{\"benchmarks\": [";
+    if (write(json_fd, header, strlen(header)) < 0) {
+        return 1;
+    }
+    benchParse();
+    benchCreateCommand();
+    benchExternal();
+    benchPipe();
+    benchHead();
+    benchJobs(10);
+    benchJobs(1000);
+    benchJobs(100000);
+    benchShells(smash_path);
+    const char* footer = "\n]}\n";
+    if (write(json_fd, footer, strlen(footer)) < 0) {
+        return 1;
+    }
+    return 0;
+}
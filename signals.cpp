@@ -15,25 +15,48 @@ void ctrlZHandler(int sig_num) {
     SmallShell& smash = SmallShell::getInstance();
     int pid = smash.getCurrentFGCmdPid();
     
-    if(pid != -1) { 
-		kill(pid, SIGSTOP);
-		smash.addStoppedJob();
+    if(pid != -1 && smash.getJobsList()->isFull()) {
+		//no room for it as a stopped job, it stays in the foreground
+		cerr << "smash error: jobs list is full" << endl;
+	} else if(pid != -1) { 
+		smash.signalCurrentFG(SIGSTOP);
+		const char* cmd_line = smash.getCurrentFGCmdLine();
+		int jid = smash.addStoppedJob();
+		smash.getTrace()->record(TraceRing::STOP, pid, jid, cmd_line);
 		smash.setCurrentFGCmd(NULL, -1, -1);
 		cout << "smash: process " << pid << " was stopped\n";
 	}
+    cout.flush();
 }
 
 void ctrlCHandler(int sig_num) {
     cout << "smash: got ctrl-C\n";
+    SmallShell::interrupted = 1;
     SmallShell& smash = SmallShell::getInstance();
     int pid = smash.getCurrentFGCmdPid();
-    smash.setCurrentFGCmd(NULL, -1, -1);
     if(pid != -1) { 
-		kill(pid, SIGKILL);
+		smash.signalCurrentFG(SIGKILL);
+		smash.setCurrentFGCmd(NULL, -1, -1);
 		cout << "smash: process " << pid << " was killed\n";
 	}
+    cout.flush();
 }
 
-void alarmHandler(int sig_num) {}
+void alarmHandler(int sig_num) {
+    Timer* expired = SmallShell::getInstance().getTimers()->expire();
+    if(expired == nullptr) {
+        return;
+    }
+    while(expired != nullptr) {
+        Timer* next = expired->next;
+        expired->fire();
+        expired = next;
+    }
+    cout.flush();
+}
+
+void chldHandler(int sig_num) {
+    JobsList::notifyChildChanged();
+}
 
 
@@ -8,5 +8,6 @@
 void ctrlZHandler(int sig_num);
 void ctrlCHandler(int sig_num);
 void alarmHandler(int sig_num);
+void chldHandler(int sig_num);
 
 #endif //CLONEOSHW1_SIGNALS_H_
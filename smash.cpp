@@ -2,9 +2,63 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <vector>
 #include "Commands.h"
 #include "signals.h"
 
+static void printPrompt(SmallShell& smash) {
+    std::cout << smash.getPrompt() << "> ";
+    std::cout.flush();
+}
+
+//run the complete lines in data, a line cut off at the end is kept in
+//pending until the rest of it shows up
+static void runLines(SmallShell& smash, const char* data, size_t len,
+                     std::string& pending, bool prompt = false) {
+    const char* end = data + len;
+    while(data < end) {
+        const char* nl = (const char*)memchr(data, '\n', end - data);
+        if(nl == nullptr) {
+            pending.append(data, end - data);
+            return;
+        }
+        pending.append(data, nl - data);
+        smash.executeCommand(pending.c_str());
+        pending.clear();
+        data = nl + 1;
+        if(prompt) {
+            printPrompt(smash);
+        }
+    }
+}
+
+//run a script file without prompting, reading it in large blocks
+static int runScript(SmallShell& smash, const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) {
+        perror("smash error: open failed");
+        return 1;
+    }
+    BlockReader reader(fd);
+    std::string pending;
+    const char* chunk;
+    ssize_t len;
+    while((len = reader.next(&chunk)) > 0) {
+        runLines(smash, chunk, len, pending);
+    }
+    if(len == -1) {
+        perror("smash error: read failed");
+    }
+    if(!pending.empty()) {
+        smash.executeCommand(pending.c_str());
+    }
+    close(fd);
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
     if(signal(SIGTSTP , ctrlZHandler)==SIG_ERR) {
         perror("smash error: failed to set ctrl-Z handler");
@@ -12,16 +66,77 @@ int main(int argc, char* argv[]) {
     if(signal(SIGINT , ctrlCHandler)==SIG_ERR) {
         perror("smash error: failed to set ctrl-C handler");
     }
+    if(signal(SIGCHLD , chldHandler)==SIG_ERR) {
+        perror("smash error: failed to set SIGCHLD handler");
+    }
+
+    if(signal(SIGALRM , alarmHandler)==SIG_ERR) {
+        perror("smash error: failed to set alarm handler");
+    }
 
-    //TODO: setup sig alarm handler
+    //stdin is read in blocks and cout goes through one buffer that is written
+    //when it fills or when smash has to, not on every endl.
+    //the writer is never freed so cout can still flush it at exit
+    std::ios::sync_with_stdio(false);
+    std::cout.rdbuf(new FdWriter(1));
 
     SmallShell& smash = SmallShell::getInstance();
-    
+
+    //the fork server is forked now, while smash is at its smallest
+    const char* fork_server = getenv("SMASH_FORK_SERVER");
+    if(fork_server != nullptr && strcmp(fork_server, "1") == 0) {
+        smash.getForkServer()->start();
+    }
+
+    //from here on the handlers above run from the event loop; they stay
+    //installed in case it can't be set up
+    smash.getEvents()->start();
+
+    if(argc > 1) {
+        smash.setInteractive(false);
+        if(strcmp(argv[1], "-c") == 0) {
+            if(argc < 3) {
+                std::cerr << "smash error: -c: option requires an argument\n";
+                return 1;
+            }
+            std::string pending;
+            runLines(smash, argv[2], strlen(argv[2]), pending);
+            if(!pending.empty()) {
+                smash.executeCommand(pending.c_str());
+            }
+            return 0;
+        }
+        return runScript(smash, argv[1]);
+    }
+
+    //stdin and the signals are waited on together, so a finished job is
+    //reaped as soon as it is done instead of on the next command
+    EventLoop* events = smash.getEvents();
+    bool watched = events->watch(0);
+    events->watch(smash.getJobsList()->getExitFd(),
+                  JobsList::notifyChildChanged);
+    std::vector<char> block(1 << 16);
+    std::string pending;
+    printPrompt(smash);
     while(true) {
-        std::cout << smash.getPrompt() << "> ";
-        std::string cmd_line;
-        std::getline(std::cin, cmd_line);
-        smash.executeCommand(cmd_line.c_str());
+        if(watched && !events->wait(0)) {
+            smash.getJobsList()->removeFinishedJobs();
+            continue;
+        }
+        ssize_t len = read(0, block.data(), block.size());
+        if(len < 0 && errno == EINTR) {
+            continue;
+        }
+        if(len < 0) {
+            perror("smash error: read failed");
+        }
+        if(len <= 0) {
+            break;
+        }
+        runLines(smash, block.data(), len, pending, true);
+    }
+    if(!pending.empty()) {
+        smash.executeCommand(pending.c_str());
     }
     return 0;
 }